@@ -0,0 +1,90 @@
+#ifndef SRK31_ASYNC_STREAMBUF_HPP_
+#define SRK31_ASYNC_STREAMBUF_HPP_
+
+#include <streambuf>
+#include <string>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstddef>
+
+/* A streambuf that hands its bytes to a writer thread, which passes them
+ * on to some other streambuf. Producers only ever copy into a bounded
+ * ring; the writer drains the ring with as large a sputn() as it can,
+ * so a slow terminal or pipe on the far end no longer stalls them.
+ *
+ * There is one producer at a time, as with any streambuf; if you want
+ * several threads writing, serialise them first.
+ *
+ * pubsync() (e.g. std::flush or std::endl) does not wait. It publishes
+ * what we have and asks the writer to sync the target once it has caught
+ * up. If you need to know the bytes have really gone, call drain(). */
+
+namespace srk31
+{
+	/* What a producer does when the ring is full. */
+	enum async_full_policy
+	{
+		async_block, // wait for the writer to make room
+		async_drop,  // throw away whatever doesn't fit, and count it
+		async_spill  // queue it on the heap; the ring stays bounded, memory doesn't
+	};
+
+	class async_streambuf : public std::streambuf
+	{
+		std::streambuf *target;
+		async_full_policy policy;
+
+		/* The ring. 'head' and 'tail' count bytes ever written and ever
+		 * drained, so head - tail is the fill level and neither wraps
+		 * in practice. */
+		std::vector<char> ring;
+		unsigned long long head;
+		unsigned long long tail;
+		/* Overflow from a full ring, under async_spill. While this is
+		 * non-empty, new bytes go here too, to keep them in order. */
+		std::deque<std::string> spill;
+		unsigned long long dropped;
+		unsigned long long syncs_requested;
+		unsigned long long syncs_done;
+		bool stopping;
+
+		std::mutex m;
+		std::condition_variable writer_wakeup;
+		std::condition_variable producer_wakeup;
+		std::thread writer;
+
+		/* Our own put area, so that single characters cost no locking. */
+		char buf[512];
+
+		void publish(const char *s, std::size_t n);
+		void publish_put_area();
+		void writer_loop();
+	public:
+		static const std::size_t default_capacity = 1u << 20;
+
+		async_streambuf(std::streambuf *target,
+			std::size_t capacity = default_capacity,
+			async_full_policy policy = async_block);
+		/* Drains everything, then stops the writer. */
+		virtual ~async_streambuf();
+
+		/* Drain, then stop the writer thread now. Anything written after
+		 * this is dropped (and counted). */
+		void close();
+
+		/* Block until everything written so far has reached the target,
+		 * and the target has been synced. */
+		void drain();
+		/* How many bytes async_drop has thrown away. */
+		unsigned long long dropped_bytes();
+	protected:
+		virtual int_type overflow(int_type c);
+		virtual std::streamsize xsputn(const char *s, std::streamsize n);
+		virtual int sync();
+	};
+}
+
+#endif
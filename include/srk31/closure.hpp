@@ -2,12 +2,35 @@
 #define SRK31CXX_CLOSURE_HPP_
 
 #include <memory>
+#include <new>
+#include <mutex>
+#include <atomic>
 #include <vector>
+#include <unordered_map>
+#include <functional>
 #include <utility>
 #include <cstring>
+#include <cstddef>
 #include <cassert>
 #include <type_traits>
 #include <ffi.h>
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+#define SRK31CXX_CLOSURE_JIT 1
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#ifdef SRK31CXX_CLOSURE_LATENCY
+#ifndef SRK31CXX_CLOSURE_STATS
+#define SRK31CXX_CLOSURE_STATS 1
+#endif
+#endif
+#ifdef SRK31CXX_CLOSURE_STATS
+#include <string>
+#include <ctime>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#endif
 
 /* This file contains template definitions that
  * generate boilerplate for libffi's closure API.
@@ -29,14 +52,20 @@ using std::vector;
 template <typename T, typename S = void>
 struct ffi_type_s
 {};
-// all pointers are the same
+// all pointers are the same, and references are passed as pointers
 template <typename T> struct ffi_type_s<T*> { static ffi_type *t() { return &ffi_type_pointer; } };
+template <typename T> struct ffi_type_s<T&> { static ffi_type *t() { return &ffi_type_pointer; } };
+template <typename T> struct ffi_type_s<T&&> { static ffi_type *t() { return &ffi_type_pointer; } };
+// only as a return type
+template<> struct ffi_type_s<void>            { static ffi_type *t() { return &ffi_type_void; } };
 // libffi has no bool
 template<> struct ffi_type_s<bool>            { static ffi_type *t() { return &ffi_type_sint8; } };
 // what about enums? map all to sint32
 template <typename T> struct ffi_type_s<T, typename std::enable_if<std::is_enum<T>::value>::type>
                                               { static ffi_type *t() { return &ffi_type_sint32; } };
 // others transfer directly
+template<> struct ffi_type_s<char>            { static ffi_type *t()
+                                              { return std::is_signed<char>::value ? &ffi_type_schar : &ffi_type_uchar; } };
 template<> struct ffi_type_s<uint8_t>         { static ffi_type *t() { return &ffi_type_uint8; } };
 template<> struct ffi_type_s< int8_t>         { static ffi_type *t() { return &ffi_type_sint8; } };
 template<> struct ffi_type_s<uint16_t>        { static ffi_type *t() { return &ffi_type_uint16; } };
@@ -49,14 +78,1023 @@ template<> struct ffi_type_s<float>           { static ffi_type *t() { return &f
 template<> struct ffi_type_s<double>          { static ffi_type *t() { return &ffi_type_double; } };
 template<> struct ffi_type_s<long double>     { static ffi_type *t() { return &ffi_type_longdouble; } };
 
+/* libffi gives our closure function a pointer to each argument. A
+ * reference argument was passed as a pointer, so for those it's a pointer
+ * to the pointer. Either way we hand the argument on without copying it;
+ * a by-value one can be moved from, since libffi's copy is a temporary. */
+template <typename T>
+struct ffi_avalue_s
+{ static T&& get(void *p) { return std::move(*reinterpret_cast<T*>(p)); } };
+template <typename T>
+struct ffi_avalue_s<T&>
+{ static T& get(void *p) { return **reinterpret_cast<T**>(p); } };
+template <typename T>
+struct ffi_avalue_s<T&&>
+{ static T&& get(void *p) { return std::move(**reinterpret_cast<T**>(p)); } };
+
+/* ... and wants the return value written through 'rvalue', except that
+ * integers narrower than a register have to be widened to a whole ffi_arg
+ * (or ffi_sarg), there's nothing to write for void, and a reference goes
+ * back as a pointer. */
+template <typename R, typename S = void>
+struct ffi_rvalue_s
+{
+	template <typename F>
+	static void store(void *rvalue, F&& f) { *reinterpret_cast<R*>(rvalue) = f(); }
+};
+template <typename R>
+struct ffi_rvalue_s<R, typename std::enable_if<
+	(std::is_integral<R>::value || std::is_enum<R>::value) && sizeof (R) < sizeof (ffi_arg)
+>::type>
+{
+	typedef typename std::conditional<std::is_unsigned<R>::value, ffi_arg, ffi_sarg>::type widened;
+	template <typename F>
+	static void store(void *rvalue, F&& f)
+	{ *reinterpret_cast<widened*>(rvalue) = static_cast<widened>(f()); }
+};
+template <>
+struct ffi_rvalue_s<void>
+{
+	template <typename F>
+	static void store(void *, F&& f) { f(); }
+};
+template <typename R>
+struct ffi_rvalue_s<R&>
+{
+	template <typename F>
+	static void store(void *rvalue, F&& f) { *reinterpret_cast<R**>(rvalue) = &f(); }
+};
+template <typename R>
+struct ffi_rvalue_s<R&&>
+{
+	template <typename F>
+	static void store(void *rvalue, F&& f) { R&& r = f(); *reinterpret_cast<R**>(rvalue) = &r; }
+};
+
+#ifdef SRK31CXX_CLOSURE_JIT
+/* Map 'len' bytes of a fresh memfd twice: writable for us, and executable
+ * for callers, so that no page is ever both. */
+inline bool map_code_pair(std::size_t len, void **writable, void **code)
+{
+	int fd = memfd_create("srk31-closures", MFD_CLOEXEC);
+	void *w = MAP_FAILED, *x = MAP_FAILED;
+	if (fd != -1 && ftruncate(fd, len) == 0)
+	{
+		w = mmap(nullptr, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+		x = mmap(nullptr, len, PROT_READ|PROT_EXEC, MAP_SHARED, fd, 0);
+	}
+	if (fd != -1) close(fd);
+	if (w == MAP_FAILED || x == MAP_FAILED)
+	{
+		if (w != MAP_FAILED) munmap(w, len);
+		if (x != MAP_FAILED) munmap(x, len);
+		return false;
+	}
+	*writable = w;
+	*code = x;
+	return true;
+}
+inline void unmap_code_pair(std::size_t len, void *writable, void *code)
+{
+	munmap(writable, len);
+	munmap(code, len);
+}
+#endif
+
+/* Every ffi_closure is the same size, whatever its signature, so one
+ * allocator serves all of them. ffi_closure_alloc() and ffi_closure_free()
+ * can mean an mmap() or munmap() per closure, and some kind of executable
+ * mapping each time. So we get closures a slab at a time, never give them
+ * back, and recycle freed ones: each thread keeps a short free list of its
+ * own, needing no locks, and trades batches with a shared depot when its
+ * list runs dry or grows long.
+ *
+ * If libffi has static trampolines, a slab is a batch of
+ * ffi_closure_alloc() calls, made together. Those trampolines are code
+ * that's never rewritten; preparing a closure only writes data. Otherwise,
+ * where we have the JIT (below), a slab is one contiguous run of
+ * ffi_closures in a memfd mapped twice, as the thunks' slabs are, and
+ * prepare() writes each one through the writable mapping. Elsewhere, or if
+ * that mapping fails, it's a batch of ffi_closure_alloc() calls again.
+ *
+ * A recycled closure still has its old trampoline contents. prepare()
+ * sets it up afresh each time, but in our own mapping it leaves the
+ * trampoline code alone if it's the same as before: rewriting code pages
+ * that have just run makes the next call through them slow.
+ *
+ * Closures over arbitrary callables keep the callable in the slot, so
+ * there's one allocator per size of inline storage; closure_allocator,
+ * the one with none, serves member function closures. */
+template <std::size_t InlineSize>
+struct closure_storage
+{
+	alignas(std::max_align_t) unsigned char storage[InlineSize];
+};
+template <>
+struct closure_storage<0>
+{};
+
+template <std::size_t InlineSize>
+class basic_closure_allocator
+{
+public:
+	struct slot : closure_storage<InlineSize>
+	{
+		ffi_closure *closure; // what we write to
+		void *code;           // what gets called
+		bool mapped;          // in our own mapping, not from libffi
+		slot *next;           // while on a free list
+	};
+	struct statistics
+	{
+		std::size_t slabs;
+		std::size_t capacity; // closures in all slabs
+		std::size_t in_use;   // allocated and not yet freed
+	};
+	enum { slab_size = 256, batch_size = 32 };
+
+	/* ffi_prep_closure_loc() for a slot of ours. */
+	static ffi_status prepare(slot *s, ffi_cif *cif,
+		void (*fun)(ffi_cif *, void *, void **, void *), void *user_data)
+	{
+		if (!s->mapped) return ffi_prep_closure_loc(s->closure, cif, fun, user_data, s->code);
+		ffi_closure scratch;
+		memset(&scratch, 0, sizeof scratch);
+		ffi_status status = ffi_prep_closure_loc(&scratch, cif, fun, user_data, s->code);
+		if (status != FFI_OK) return status;
+		if (memcmp(scratch.tramp, s->closure->tramp, sizeof scratch.tramp) != 0)
+		{
+			memcpy(s->closure, &scratch, sizeof scratch);
+			return FFI_OK;
+		}
+		s->closure->cif = scratch.cif;
+		s->closure->fun = scratch.fun;
+		s->closure->user_data = scratch.user_data;
+		return FFI_OK;
+	}
+
+	/* Never destroyed, so closures may outlive static destruction. */
+	static basic_closure_allocator& instance()
+	{
+		static basic_closure_allocator *a = new basic_closure_allocator;
+		return *a;
+	}
+
+	slot *allocate()
+	{
+		thread_cache *c = my_cache();
+		if (!c) return allocate_from_depot();
+		if (!c->head) refill(*c);
+		slot *s = c->head;
+		c->head = s->next;
+		--c->count;
+		bump(c->allocs);
+		return s;
+	}
+	/* Many at once, taking the lock once. */
+	void allocate(slot **out, std::size_t n)
+	{
+		thread_cache *c = my_cache();
+		std::lock_guard<std::mutex> lk(m);
+		for (std::size_t i = 0; i < n; ++i)
+		{
+			if (!depot)
+			{
+				try { new_slab(); }
+				catch (...) { put_back(out, i); throw; }
+			}
+			out[i] = depot;
+			depot = depot->next;
+		}
+		if (c) c->allocs.store(c->allocs.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+		else retired_allocs += n;
+	}
+	void deallocate(slot **ss, std::size_t n)
+	{
+		thread_cache *c = my_cache();
+		std::lock_guard<std::mutex> lk(m);
+		put_back(ss, n);
+		if (c) c->frees.store(c->frees.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+		else retired_frees += n;
+	}
+	void deallocate(slot *s)
+	{
+		thread_cache *c = my_cache();
+		if (!c) { free_to_depot(s); return; }
+		s->next = c->head;
+		c->head = s;
+		++c->count;
+		bump(c->frees);
+		if (c->count > 2 * batch_size) give_back(*c, batch_size);
+	}
+
+	statistics stats()
+	{
+		std::lock_guard<std::mutex> lk(m);
+		unsigned long long allocs = retired_allocs, frees = retired_frees;
+		for (thread_cache *c : caches)
+		{
+			allocs += c->allocs.load(std::memory_order_relaxed);
+			frees += c->frees.load(std::memory_order_relaxed);
+		}
+		return (statistics) { slabs.size(), nslots, (std::size_t) (allocs - frees) };
+	}
+
+private:
+	struct thread_cache
+	{
+		slot *head;
+		std::size_t count;
+		/* Only the owning thread writes these; stats() reads them. */
+		std::atomic<unsigned long long> allocs, frees;
+		thread_cache() : head(nullptr), count(0), allocs(0), frees(0)
+		{ instance().enrol(this); }
+		~thread_cache() { instance().retire(this); }
+	};
+	static void bump(std::atomic<unsigned long long>& n)
+	{ n.store(n.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); }
+
+	std::mutex m;
+	std::vector< unique_ptr<slot[]> > slabs;
+	std::size_t nslots;
+	slot *depot;
+	std::vector<thread_cache *> caches;
+	unsigned long long retired_allocs, retired_frees;
+
+	basic_closure_allocator() : nslots(0), depot(nullptr), retired_allocs(0), retired_frees(0) {}
+
+	/* Null once the calling thread's cache has been destroyed, during
+	 * thread exit; then we go straight to the depot. */
+	static thread_cache *my_cache()
+	{
+		static thread_local bool dead;
+		if (dead) return nullptr;
+		struct owner
+		{
+			thread_cache c;
+			~owner() { dead = true; }
+		};
+		static thread_local owner o;
+		return &o.c;
+	}
+	void enrol(thread_cache *c)
+	{
+		std::lock_guard<std::mutex> lk(m);
+		caches.push_back(c);
+	}
+	void retire(thread_cache *c)
+	{
+		give_back(*c, c->count);
+		std::lock_guard<std::mutex> lk(m);
+		retired_allocs += c->allocs.load(std::memory_order_relaxed);
+		retired_frees += c->frees.load(std::memory_order_relaxed);
+		for (auto i = caches.begin(); i != caches.end(); ++i)
+		{
+			if (*i == c) { caches.erase(i); break; }
+		}
+	}
+
+	/* Call with the lock held. */
+	void put_back(slot **ss, std::size_t n)
+	{
+		for (std::size_t i = 0; i < n; ++i)
+		{
+			ss[i]->next = depot;
+			depot = ss[i];
+		}
+	}
+	void new_slab()
+	{
+		unique_ptr<slot[]> sl(new slot[slab_size]);
+		std::size_t n = 0;
+#ifdef SRK31CXX_CLOSURE_JIT
+		void *w, *x;
+		bool mapped = !static_trampolines()
+			&& map_code_pair(slab_size * sizeof (ffi_closure), &w, &x);
+		for (; mapped && n < slab_size; ++n)
+		{
+			sl[n].closure = static_cast<ffi_closure*>(w) + n;
+			sl[n].code = static_cast<ffi_closure*>(x) + n;
+			sl[n].mapped = true;
+			sl[n].next = &sl[n + 1];
+		}
+#endif
+		for (; n < slab_size; ++n)
+		{
+			sl[n].closure = reinterpret_cast<ffi_closure*>(
+				ffi_closure_alloc(sizeof (ffi_closure), &sl[n].code)
+			);
+			if (!sl[n].closure) break;
+			sl[n].mapped = false;
+			sl[n].next = &sl[n + 1];
+		}
+		if (n == 0) throw std::bad_alloc();
+		sl[n - 1].next = depot;
+		depot = &sl[0];
+		nslots += n;
+		slabs.push_back(std::move(sl));
+	}
+#ifdef SRK31CXX_CLOSURE_JIT
+	/* libffi doesn't say whether it has static trampolines, so we ask it
+	 * for a closure and look. A dynamic trampoline is written into the
+	 * closure's tramp[]; with a static one, only its first word is used,
+	 * to point at the trampoline, so whatever we leave after that stays. */
+	static bool static_trampolines()
+	{
+		static const bool yes = []() {
+			void *code;
+			ffi_closure *c = reinterpret_cast<ffi_closure*>(
+				ffi_closure_alloc(sizeof (ffi_closure), &code));
+			if (!c) return false;
+			static ffi_cif cif;
+			char *rest = c->tramp + sizeof (void *);
+			std::size_t nrest = sizeof c->tramp - sizeof (void *);
+			memset(rest, 0xa5, nrest);
+			bool found = ffi_prep_cif(&cif, FFI_DEFAULT_ABI, 0, &ffi_type_void, nullptr) == FFI_OK
+				&& ffi_prep_closure_loc(c, &cif, [](ffi_cif *, void *, void **, void *) {},
+					nullptr, code) == FFI_OK;
+			for (std::size_t i = 0; found && i < nrest; ++i)
+			{
+				if (static_cast<unsigned char>(rest[i]) != 0xa5) found = false;
+			}
+			ffi_closure_free(c);
+			return found;
+		}();
+		return yes;
+	}
+#endif
+	void refill(thread_cache& c)
+	{
+		std::lock_guard<std::mutex> lk(m);
+		if (!depot) new_slab();
+		while (depot && c.count < batch_size)
+		{
+			slot *s = depot;
+			depot = s->next;
+			s->next = c.head;
+			c.head = s;
+			++c.count;
+		}
+	}
+	void give_back(thread_cache& c, std::size_t n)
+	{
+		std::lock_guard<std::mutex> lk(m);
+		for (; n > 0 && c.head; --n)
+		{
+			slot *s = c.head;
+			c.head = s->next;
+			--c.count;
+			s->next = depot;
+			depot = s;
+		}
+	}
+	slot *allocate_from_depot()
+	{
+		std::lock_guard<std::mutex> lk(m);
+		if (!depot) new_slab();
+		slot *s = depot;
+		depot = s->next;
+		++retired_allocs;
+		return s;
+	}
+	void free_to_depot(slot *s)
+	{
+		std::lock_guard<std::mutex> lk(m);
+		s->next = depot;
+		depot = s;
+		++retired_frees;
+	}
+};
+
+typedef basic_closure_allocator<0> closure_allocator;
+
+#ifdef SRK31CXX_CLOSURE_JIT
+/* The JIT, such as it is. For a member function whose arguments all fit in
+ * registers, we don't need libffi's generic unpacking at all: a plain
+ * function taking the object pointer first, then the member function's
+ * arguments, does the job, and all a closure needs to do is shift the
+ * integer argument registers along by one, load the object pointer into
+ * the first, and jump there. Floating-point arguments are in their own
+ * registers and stack arguments stay where they are, so neither is
+ * disturbed. The thunk doing that is a fixed few instructions; only the
+ * two pointers it loads vary.
+ *
+ * Thunks live in slabs of a memfd mapped twice: writable for us, and
+ * executable for callers, so that no page is ever both. A free thunk's
+ * first word links it into the free list; the executable address of
+ * each is kept in its last word. Thunks are recycled, never unmapped. */
+class thunk_allocator
+{
+public:
+	enum { thunk_size = 64, slab_size = 65536 };
+#if defined(__x86_64__)
+	enum { max_int_args = 6 };
+#else
+	enum { max_int_args = 8 };
+#endif
+	/* Returns the thunk's executable address and sets 'writable' to the
+	 * address the deleter needs; returns null if we can't make one. */
+	void *make(void *obj, void (*target)(), void **writable)
+	{
+		char *w = allocate();
+		if (!w) return nullptr;
+		void *code = code_addr(w);
+		emit(w, code, obj, target);
+		*writable = w;
+		return code;
+	}
+	void free(void *writable)
+	{
+		std::lock_guard<std::mutex> lk(m);
+		*reinterpret_cast<char **>(writable) = free_list;
+		free_list = static_cast<char *>(writable);
+	}
+
+	/* Write a thunk at 'w', to be run at 'code'. */
+	static void emit(char *w, void *code, void *obj, void (*target)())
+	{
+#if defined(__x86_64__)
+		(void) code; // x86 keeps its icache coherent
+		static const unsigned char prologue[] = {
+			0xf3, 0x0f, 0x1e, 0xfa, // endbr64 (a nop unless CET is on)
+			0x4d, 0x89, 0xc1,       // mov %r8, %r9
+			0x49, 0x89, 0xc8,       // mov %rcx, %r8
+			0x48, 0x89, 0xd1,       // mov %rdx, %rcx
+			0x48, 0x89, 0xf2,       // mov %rsi, %rdx
+			0x48, 0x89, 0xfe,       // mov %rdi, %rsi
+			0x48, 0xbf              // movabs $obj, %rdi
+		};
+		char *p = w;
+		memcpy(p, prologue, sizeof prologue); p += sizeof prologue;
+		memcpy(p, &obj, 8); p += 8;
+		*p++ = 0x49; *p++ = 0xbb;   // movabs $target, %r11
+		memcpy(p, &target, 8); p += 8;
+		*p++ = 0x41; *p++ = 0xff; *p++ = 0xe3; // jmp *%r11
+#else
+		uint32_t insns[10];
+		for (unsigned i = 0; i < 7; ++i)
+		{
+			unsigned d = 7 - i;
+			insns[i] = 0xaa0003e0u | ((d - 1) << 16) | d; // mov x<d>, x<d-1>
+		}
+		insns[7] = 0x58000060u; // ldr x0, obj
+		insns[8] = 0x58000090u; // ldr x16, target
+		insns[9] = 0xd61f0200u; // br x16
+		memcpy(w, insns, sizeof insns);
+		memcpy(w + 40, &obj, 8);
+		memcpy(w + 48, &target, 8);
+		__builtin___clear_cache((char *) code, (char *) code + thunk_size);
+#endif
+	}
+
+	/* Whole blocks of thunks, for closure tables. Mapping one costs far
+	 * more than filling it, so we keep a few freed ones for reuse. We give
+	 * the smallest spare that fits, and only if it's no more than
+	 * max_spare_waste times what was asked for, so that small tables
+	 * don't pin big blocks. On success, 'len' is updated to the size of
+	 * the block we gave. */
+	enum { max_spare_blocks = 16, max_spare_waste = 2 };
+	bool acquire_block(std::size_t *len, void **writable, void **code)
+	{
+		{
+			std::lock_guard<std::mutex> lk(m);
+			auto best = spare.end();
+			for (auto i = spare.begin(); i != spare.end(); ++i)
+			{
+				if (i->len < *len || i->len > max_spare_waste * *len) continue;
+				if (best == spare.end() || i->len < best->len) best = i;
+			}
+			if (best != spare.end())
+			{
+				*len = best->len; *writable = best->w; *code = best->x;
+				spare.erase(best);
+				return true;
+			}
+		}
+		return map_code_pair(*len, writable, code);
+	}
+	void release_block(std::size_t len, void *writable, void *code)
+	{
+		{
+			std::lock_guard<std::mutex> lk(m);
+			if (spare.size() < max_spare_blocks)
+			{
+				spare.push_back((block) { len, writable, code });
+				return;
+			}
+		}
+		unmap_code_pair(len, writable, code);
+	}
+
+	/* Never destroyed, like closure_allocator. */
+	static thunk_allocator& instance()
+	{
+		static thunk_allocator *a = new thunk_allocator;
+		return *a;
+	}
+private:
+	std::mutex m;
+	char *free_list;
+	bool failed;
+	struct block { std::size_t len; void *w; void *x; };
+	std::vector<block> spare;
+	thunk_allocator() : free_list(nullptr), failed(false) {}
+
+	static void *&code_addr(char *w)
+	{ return *reinterpret_cast<void **>(w + thunk_size - sizeof (void*)); }
+	char *allocate()
+	{
+		std::lock_guard<std::mutex> lk(m);
+		if (!free_list && !failed) new_slab();
+		char *w = free_list;
+		if (w) free_list = *reinterpret_cast<char **>(w);
+		return w;
+	}
+	/* Call with the lock held. If we can't map a slab, we give up for
+	 * good, and every closure goes through libffi. */
+	void new_slab()
+	{
+		void *w, *x;
+		if (!map_code_pair(slab_size, &w, &x))
+		{
+			failed = true;
+			return;
+		}
+		for (std::size_t off = 0; off < slab_size; off += thunk_size)
+		{
+			char *t = static_cast<char *>(w) + off;
+			code_addr(t) = static_cast<char *>(x) + off;
+			*reinterpret_cast<char **>(t) = free_list;
+			free_list = t;
+		}
+	}
+};
+
+/* Whether the thunk can pass a T. */
+template <typename T>
+struct thunk_arg
+{
+	static const bool ok = std::is_integral<T>::value || std::is_enum<T>::value
+		|| std::is_pointer<T>::value || std::is_reference<T>::value
+		|| std::is_floating_point<T>::value;
+	static const unsigned int_regs = std::is_floating_point<T>::value ? 0 : 1;
+};
+template <typename... Ts> struct thunk_args;
+template <> struct thunk_args<>
+{ static const bool ok = true; static const unsigned int_regs = 0; };
+template <typename T, typename... Ts> struct thunk_args<T, Ts...>
+{
+	static const bool ok = thunk_arg<T>::ok && thunk_args<Ts...>::ok;
+	static const unsigned int_regs = thunk_arg<T>::int_regs + thunk_args<Ts...>::int_regs;
+};
+#endif
+
+#ifdef SRK31CXX_CLOSURE_STATS
+/* Instrumentation, for finding out which callbacks are hot. Define
+ * SRK31CXX_CLOSURE_STATS before including this file to count calls to
+ * each closure function, i.e. each member function (or callable type) we
+ * make closures for, however many objects it's bound to; also define
+ * SRK31CXX_CLOSURE_LATENCY for a histogram of how long the calls took, in
+ * power-of-two buckets of TSC ticks (on x86) or nanoseconds. Without
+ * these, none of it is compiled.
+ *
+ * Each thread counts into its own counters, so calls never contend;
+ * reading the statistics adds them up. A closure function becomes a
+ * "site" the first time it's called. */
+class closure_stats
+{
+	struct counters;
+public:
+	enum { nbuckets = 32, chunk_size = 64, max_chunks = 256 };
+	struct site_totals
+	{
+		std::string name;
+		unsigned long long calls;
+		unsigned long long hist[nbuckets];
+	};
+
+	static closure_stats& instance()
+	{
+		static closure_stats *s = new closure_stats;
+		return *s;
+	}
+	static unsigned long long now()
+	{
+#if defined(__x86_64__) || defined(__i386__)
+		return __rdtsc();
+#else
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+	}
+	static const char *unit()
+	{
+#if defined(__x86_64__) || defined(__i386__)
+		return "ticks";
+#else
+		return "ns";
+#endif
+	}
+
+	std::size_t add_site(const char *name)
+	{
+		/* From __PRETTY_FUNCTION__, the template arguments say it all. */
+		const char *with = strstr(name, "[with ");
+		std::lock_guard<std::mutex> lk(m);
+		site_totals t = { with ? with : name, 0, {} };
+		retired.push_back(t);
+		return retired.size() - 1;
+	}
+
+	/* Counts one call to 'site' for as long as it's in scope. */
+	class scope
+	{
+		counters *c;
+#ifdef SRK31CXX_CLOSURE_LATENCY
+		unsigned long long start;
+#endif
+	public:
+		scope(std::size_t site) : c(instance().counters_for(site))
+		{
+			if (c) bump(c->calls);
+#ifdef SRK31CXX_CLOSURE_LATENCY
+			start = now();
+#endif
+		}
+#ifdef SRK31CXX_CLOSURE_LATENCY
+		~scope()
+		{
+			if (!c) return;
+			unsigned long long d = now() - start;
+			unsigned b = d ? 64 - __builtin_clzll(d) : 0; // d < 2^b
+			bump(c->hist[b < nbuckets ? b : nbuckets - 1]);
+		}
+#endif
+	};
+
+	/* Everything so far, summed over threads. */
+	std::vector<site_totals> totals()
+	{
+		std::lock_guard<std::mutex> lk(m);
+		std::vector<site_totals> out = retired;
+		for (thread_counters *t : threads) add(out, *t);
+		return out;
+	}
+
+	/* Write out the totals, with each site's histogram a tab further in
+	 * than the site. If 'out' is an indenting stream, the sites go one
+	 * level in, and the stream's own level changes start and end them.
+	 * Sites never called are left out. */
+	template <typename Out>
+	void dump(Out& out)
+	{
+		std::vector<site_totals> ts = totals();
+		out << "closure calls:";
+		const char *sep = inc(out, 0) ? "" : "\n";
+		for (const site_totals& t : ts)
+		{
+			if (!t.calls) continue;
+			out << sep << t.calls << " call(s) to " << t.name;
+			sep = "\n";
+#ifdef SRK31CXX_CLOSURE_LATENCY
+			for (unsigned b = 0; b < nbuckets; ++b)
+			{
+				if (!t.hist[b]) continue;
+				out << "\n\t< " << (1ull << b) << " " << unit() << ": " << t.hist[b];
+			}
+#endif
+		}
+		if (!dec(out, 0)) out << "\n";
+		out.flush();
+	}
+
+private:
+	struct counters
+	{
+		std::atomic<unsigned long long> calls;
+		std::atomic<unsigned long long> hist[nbuckets];
+	};
+	/* One per thread. Chunks of counters are allocated as sites get called,
+	 * and never move, so totals() can read them while the thread runs. */
+	struct thread_counters
+	{
+		std::atomic<counters *> chunks[max_chunks];
+		thread_counters()
+		{
+			for (auto& c : chunks) c.store(nullptr, std::memory_order_relaxed);
+			instance().enrol(this);
+		}
+		~thread_counters()
+		{
+			instance().retire(this);
+			for (auto& c : chunks) delete[] c.load(std::memory_order_relaxed);
+		}
+	};
+	static void bump(std::atomic<unsigned long long>& n)
+	{ n.store(n.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); }
+
+	std::mutex m;
+	std::vector<thread_counters *> threads;
+	std::vector<site_totals> retired; // one per site; totals from exited threads
+	closure_stats() {}
+
+	/* Null if there are too many sites, or the thread is exiting. */
+	counters *counters_for(std::size_t site)
+	{
+		static thread_local bool dead;
+		if (dead || site >= chunk_size * max_chunks) return nullptr;
+		struct owner
+		{
+			thread_counters t;
+			~owner() { dead = true; }
+		};
+		static thread_local owner o;
+		std::atomic<counters *>& chunk = o.t.chunks[site / chunk_size];
+		counters *c = chunk.load(std::memory_order_relaxed);
+		if (!c)
+		{
+			c = new counters[chunk_size]();
+			chunk.store(c, std::memory_order_release);
+		}
+		return &c[site % chunk_size];
+	}
+	void enrol(thread_counters *t)
+	{
+		std::lock_guard<std::mutex> lk(m);
+		threads.push_back(t);
+	}
+	void retire(thread_counters *t)
+	{
+		std::lock_guard<std::mutex> lk(m);
+		add(retired, *t);
+		for (auto i = threads.begin(); i != threads.end(); ++i)
+		{
+			if (*i == t) { threads.erase(i); break; }
+		}
+	}
+	/* Call with the lock held. */
+	static void add(std::vector<site_totals>& out, thread_counters& t)
+	{
+		for (std::size_t site = 0; site < out.size(); ++site)
+		{
+			counters *c = t.chunks[site / chunk_size].load(std::memory_order_acquire);
+			if (!c) continue;
+			counters& cs = c[site % chunk_size];
+			out[site].calls += cs.calls.load(std::memory_order_relaxed);
+			for (unsigned b = 0; b < nbuckets; ++b)
+				out[site].hist[b] += cs.hist[b].load(std::memory_order_relaxed);
+		}
+	}
+
+	/* Indent, if 'out' is a stream that can; say whether it did. */
+	template <typename Out>
+	static auto inc(Out& out, int) -> decltype(out.inc_level(), bool()) { out.inc_level(); return true; }
+	template <typename Out>
+	static bool inc(Out&, long) { return false; }
+	template <typename Out>
+	static auto dec(Out& out, int) -> decltype(out.dec_level(), bool()) { out.dec_level(); return true; }
+	template <typename Out>
+	static bool dec(Out&, long) { return false; }
+};
+#endif
+
+/* The cif and the argument type array depend only on the signature,
+ * so all closures of a signature share one of each. They're built the
+ * first time a closure is made; initialization of a function-local
+ * static is thread-safe, so racing makers all see the same one. They
+ * must outlive every closure, and being static, they do. */
+template <typename RetType, typename... Args>
+struct ffi_signature_s
+{
+	ffi_type *atypes[sizeof...(Args) + 1]; // +1: no zero-length arrays
+	ffi_cif c;
+	ffi_signature_s() : atypes{ffi_type_s<Args>::t()..., nullptr}
+	{
+		ffi_status status = ffi_prep_cif(&c,
+			/* ffi_abi abi */ FFI_DEFAULT_ABI,
+			/*unsigned int nargs */ sizeof...(Args),
+			/* ffi_type *rtype */ ffi_type_s<RetType>::t(),
+			/* ffi_type **atypes */ atypes
+		);
+		if (status != FFI_OK) throw 1; // FIXME: better thing to throw (or return null?)
+	}
+	static ffi_cif *cif()
+	{
+		static ffi_signature_s s;
+		return &s.c;
+	}
+};
+
+/* Optionally, closures can be shared: ask for one for the same object and
+ * member function twice and you get the same function pointer, counted
+ * by a shared_ptr, which frees the closure when the last user lets go.
+ * The table only holds weak references. It's split into shards, each with
+ * its own lock, chosen by hashing the key, so threads registering
+ * different handlers rarely contend. One cache per signature; like the
+ * allocators, it's never destroyed. */
+template <typename Sig>
+class closure_cache;
+template <typename RetType, typename... Args>
+class closure_cache<RetType(Args...)>
+{
+public:
+	typedef RetType fun_type(Args...);
+	typedef std::shared_ptr<fun_type> ptr;
+	enum { nshards = 16 };
+
+	static closure_cache& instance()
+	{
+		static closure_cache *c = new closure_cache;
+		return *c;
+	}
+
+	/* 'which' identifies the member function; 'make' makes a fresh closure
+	 * as a unique_ptr, whose deleter we copy. */
+	template <typename Make>
+	ptr get(void *obj, void (*which)(), Make make)
+	{
+		key k = { obj, which };
+		shard& sh = shards[key_hash()(k) % nshards];
+		{
+			std::lock_guard<std::mutex> lk(sh.m);
+			ptr p = lookup(sh, k);
+			if (p) return p;
+		}
+		/* Make it unlocked: if we lose a race for this key, or fail,
+		 * freeing it takes the lock. */
+		auto u = make();
+		auto d = u.get_deleter();
+		ptr mine(u.release(), [this, k, d](fun_type *fp) { forget(k); d(fp); });
+		std::lock_guard<std::mutex> lk(sh.m);
+		ptr theirs = lookup(sh, k);
+		if (theirs) return theirs; // 'mine' goes once we've unlocked
+		sh.table[k] = mine;
+		return mine;
+	}
+
+	/* How many closures the cache knows of, live or about to go. */
+	std::size_t size()
+	{
+		std::size_t n = 0;
+		for (shard& sh : shards)
+		{
+			std::lock_guard<std::mutex> lk(sh.m);
+			n += sh.table.size();
+		}
+		return n;
+	}
+private:
+	struct key
+	{
+		void *obj;
+		void (*which)();
+		bool operator==(const key& k) const { return obj == k.obj && which == k.which; }
+	};
+	struct key_hash
+	{
+		std::size_t operator()(const key& k) const
+		{
+			std::size_t h = std::hash<void*>()(k.obj);
+			return h ^ (std::hash<void*>()(reinterpret_cast<void*>(k.which)) + 0x9e3779b9 + (h << 6) + (h >> 2));
+		}
+	};
+	struct shard
+	{
+		std::mutex m;
+		std::unordered_map< key, std::weak_ptr<fun_type>, key_hash > table;
+	};
+	shard shards[nshards];
+
+	closure_cache() {}
+	/* Call with the shard's lock held. */
+	static ptr lookup(shard& sh, const key& k)
+	{
+		auto found = sh.table.find(k);
+		return (found == sh.table.end()) ? ptr() : found->second.lock();
+	}
+	/* The last reference to k's closure has gone. Unless k has already
+	 * been given a new one, drop its entry. */
+	void forget(const key& k)
+	{
+		shard& sh = shards[key_hash()(k) % nshards];
+		std::lock_guard<std::mutex> lk(sh.m);
+		auto found = sh.table.find(k);
+		if (found != sh.table.end() && found->second.expired()) sh.table.erase(found);
+	}
+};
+
+/* Closures with no code generated at run time, for systems that won't
+ * map anything executable that was ever writable, and so no libffi
+ * closures either. For each signature and pool size N, the compiler
+ * instantiates N ordinary functions, the trampolines; trampoline i looks
+ * up slot i of a static table, to find its object and a function to pass
+ * it to along with the arguments. Handing out a closure is just claiming
+ * a free slot, and a call is two loads and an indirect call: no
+ * marshalling. The catch is that N is fixed at compile time; when all
+ * the slots are taken, making another throws std::bad_alloc. */
+template <typename Sig, std::size_t N>
+class static_closure_pool;
+template <typename RetType, typename... Args, std::size_t N>
+class static_closure_pool<RetType(Args...), N>
+{
+public:
+	typedef RetType fun_type(Args...);
+	typedef RetType erased_fun_type(void *, Args...);
+
+	struct deleter
+	{
+		std::size_t slot;
+		deleter() : slot(N) {}
+		deleter(std::size_t slot) : slot(slot) {}
+		void operator()(fun_type *) const { if (slot < N) release(slot); }
+	};
+	typedef std::unique_ptr<fun_type, deleter> ptr;
+
+	/* Calls to the result go to 'call(obj, args...)'. */
+	static ptr make(void *obj, erased_fun_type *call)
+	{
+		std::size_t i = acquire();
+		table[i].call.store(call, std::memory_order_relaxed);
+		table[i].obj.store(obj, std::memory_order_release);
+		return ptr(trampoline(i, std::make_index_sequence<N>()), deleter(i));
+	}
+	/* How many slots are taken. */
+	static std::size_t in_use()
+	{
+		free_slots& f = free_list();
+		std::lock_guard<std::mutex> lk(f.m);
+		return f.next_unused - f.freed.size();
+	}
+private:
+	struct slot_entry
+	{
+		std::atomic<void *> obj;
+		std::atomic<erased_fun_type *> call;
+	};
+	static slot_entry table[N];
+
+	template <std::size_t I>
+	static RetType tramp(Args... args)
+	{
+		void *obj = table[I].obj.load(std::memory_order_acquire);
+		return table[I].call.load(std::memory_order_relaxed)(obj, std::forward<Args>(args)...);
+	}
+	template <std::size_t... Is>
+	static fun_type *trampoline(std::size_t i, std::index_sequence<Is...>)
+	{
+		static fun_type *const tramps[] = { &tramp<Is>... };
+		return tramps[i];
+	}
+
+	struct free_slots
+	{
+		std::mutex m;
+		std::size_t next_unused;
+		std::vector<std::size_t> freed;
+		free_slots() : next_unused(0) {}
+	};
+	/* Never destroyed, so closures may outlive static destruction. */
+	static free_slots& free_list()
+	{
+		static free_slots *f = new free_slots;
+		return *f;
+	}
+	static std::size_t acquire()
+	{
+		free_slots& f = free_list();
+		std::lock_guard<std::mutex> lk(f.m);
+		if (!f.freed.empty())
+		{
+			std::size_t i = f.freed.back();
+			f.freed.pop_back();
+			return i;
+		}
+		if (f.next_unused == N) throw std::bad_alloc();
+		return f.next_unused++;
+	}
+	static void release(std::size_t i)
+	{
+		table[i].obj.store(nullptr, std::memory_order_relaxed);
+		free_slots& f = free_list();
+		std::lock_guard<std::mutex> lk(f.m);
+		f.freed.push_back(i);
+	}
+};
+template <typename RetType, typename... Args, std::size_t N>
+typename static_closure_pool<RetType(Args...), N>::slot_entry
+static_closure_pool<RetType(Args...), N>::table[N];
+
 /* Closure glue code specific to a particular class type and member function
  * signature is generated by this template. */
 template <typename ClassType, typename RetType, typename... MemberFunArgs>
 struct ffi_closure_s
 {
 	/* This is the type of (a pointer to) the member function that we
-	 * want to generate a closure for. It's any member function. */
+	 * want to generate a closure for. It's any member function, const or
+	 * not. (A noexcept one converts to one of these.) */
 	typedef RetType (ClassType::*MemberFunPtrType)(MemberFunArgs...);
+	typedef RetType (ClassType::*ConstMemberFunPtrType)(MemberFunArgs...) const;
 
 	/* All generated libffi closures do a similar thing: they slurp their
 	 * arguments from the calling context's stack/registers, pack them into
@@ -97,54 +1135,52 @@ struct ffi_closure_s
 
 	/* To unpack arguments from the array of pointers into our actual
 	 * bona fide C++ member function call, we use some template magic.
-	 * First we generate a std::tuple from the array. Doing so is
-	 * deceptively simple thanks to std::tie and the miracle of the
-	 * '...' pattern expansion operator. Our caller will instantiate 'Is'
-	 * with an ascending sequence of integers from zero.
+	 * Our caller instantiates 'Is' with an ascending sequence of integers
+	 * from zero, and the '...' expansion walks it in lock-step with
+	 * 'MemberFunArgs', fetching each argument straight out of 'avalue'.
+	 * (We used to go via a std::tuple, copying every argument.)
 	 *
-	 * At first it's a bit mysterious how 'seq' gets expanded in unison
-	 * with 'MemberFunArgs'. I think this is just the semantics of
-	 * '...'-expansion of expressions with two or more template argument packs
-	 * (here Is and MemberFunArgs)... they get expanded in lock-step. */
-	template <std::size_t... Is>
-	static
-	std::tuple<MemberFunArgs...>
-	get_tuple(void **avalue, std::index_sequence<Is...> seq)
+	 * MemFun is either of our member function pointer types. */
+	template <typename MemFun, MemFun member_fun, std::size_t... Is>
+	static RetType call_member_fun(ClassType *obj, void **avalue, std::index_sequence<Is...>)
 	{
-		return std::tie<MemberFunArgs...>(
-			*reinterpret_cast<MemberFunArgs *>(avalue[ Is ])...
-		);
+		(void) avalue; // if there are no arguments
+		return (obj->*member_fun)(ffi_avalue_s<MemberFunArgs>::get(avalue[ Is ])...);
 	}
 
-	/* Now we need a helper that can call a function given a tuple,
-	 * i.e. make it into a bona fide argument pack. Again the ascending
-	 * sequence of integers helps us, this time getting the nth item
-	 * from the tuple. */
-	template <std::size_t... Is>
-	static
-	RetType call_member_fun_with_tuple(
-		ClassType *obj,
-		MemberFunPtrType member_fun,
-		const std::tuple < MemberFunArgs ... >& tuple,
-		std::index_sequence<Is...> seq
-	)
+#ifdef SRK31CXX_CLOSURE_STATS
+	template <typename MemFun, MemFun member_fun>
+	static std::size_t stats_site()
 	{
-		return (obj->*member_fun)(std::get<Is>(tuple)...);
+		static const std::size_t site = closure_stats::instance().add_site(__PRETTY_FUNCTION__);
+		return site;
 	}
+#endif
 
 	/* Now we plumb these together into the actual function we promised. */
-	template <MemberFunPtrType member_fun_ptr>
+	template <typename MemFun, MemFun member_fun>
 	static void
-	the_fun(ffi_cif *cif, void *rvalue, void **avalue, void *data)
+	dispatch(ffi_cif *, void *rvalue, void **avalue, void *data)
 	{
+#ifdef SRK31CXX_CLOSURE_STATS
+		closure_stats::scope counted(stats_site<MemFun, member_fun>());
+#endif
 		ClassType *obj =  reinterpret_cast<ClassType *>(data);
-		*reinterpret_cast<RetType*>(rvalue) = call_member_fun_with_tuple(
-			obj,
-			member_fun_ptr,
-			get_tuple(avalue, std::index_sequence_for<MemberFunArgs...>()),
-			std::index_sequence_for<MemberFunArgs...>()
-		);
+		ffi_rvalue_s<RetType>::store(rvalue, [obj, avalue]() -> RetType {
+			return call_member_fun<MemFun, member_fun>(obj, avalue,
+				std::index_sequence_for<MemberFunArgs...>());
+		});
 	}
+	template <MemberFunPtrType member_fun>
+	static void
+	the_fun(ffi_cif *cif, void *rvalue, void **avalue, void *data)
+	{ dispatch<MemberFunPtrType, member_fun>(cif, rvalue, avalue, data); }
+	template <ConstMemberFunPtrType member_fun>
+	static void
+	the_fun(ffi_cif *cif, void *rvalue, void **avalue, void *data)
+	{ dispatch<ConstMemberFunPtrType, member_fun>(cif, rvalue, avalue, data); }
+
+	static ffi_cif *get_cif() { return ffi_signature_s<RetType, MemberFunArgs...>::cif(); }
 
 	/* If we're dynamically creating closures, how do they get destroyed?
 	 * It seems reasonable to use std::unique_ptr.
@@ -155,53 +1191,242 @@ struct ffi_closure_s
 	 * free, but it's the code pointer that is most useful to client code.
 	 *
 	 * For now, we abuse the deleter... just use the deleter object to
-	 * remember the closure pointer and any other state we need. Then the
-	 * unique_ptr can pointer to the function, so we give it a function
-	 * type.
-	 *
-	 * In our rag-bag of state on the deleter, we need the cif and type info.
-	 * It's extravagant that they are two separate heap allocations, but it'll
-	 * do for now. They need to live as long as the function lives. */
+	 * remember the closure's slot in the closure_allocator (or its thunk,
+	 * if it's one of those). Then the unique_ptr can point to the function,
+	 * so we give it a function type. */
 	struct closure_deleter {
-		ffi_closure *closure;
-		std::unique_ptr< vector<ffi_type *> > typevec;
-		std::unique_ptr< ffi_cif > p_cif;
-		closure_deleter() : closure(nullptr), typevec(nullptr), p_cif(nullptr) {}
-		closure_deleter(ffi_closure *closure,
-			std::unique_ptr< vector<ffi_type *> > &&typevec,
-			std::unique_ptr<ffi_cif>&& p_cif)
-		 : closure(closure), typevec(std::move(typevec)), p_cif(std::move(p_cif)) {}
-		void operator()( RetType(*fp)(MemberFunArgs...) ) const
-		{ if (closure) ffi_closure_free(closure); }
+		closure_allocator::slot *slot;
+		void *thunk;
+		closure_deleter() : slot(nullptr), thunk(nullptr) {}
+		closure_deleter(closure_allocator::slot *slot) : slot(slot), thunk(nullptr) {}
+		void operator()( RetType(*)(MemberFunArgs...) ) const
+		{
+			if (slot) closure_allocator::instance().deallocate(slot);
+#ifdef SRK31CXX_CLOSURE_JIT
+			if (thunk) thunk_allocator::instance().free(thunk);
+#endif
+		}
 	};
 
 	/* Now we actually have the ingredients necessary to call libffi and
 	 * set up a brand new closure, passing the relevant template instance
 	 * that generates our 'the_fun'. We created templates above  */
+	template <typename MemFun, MemFun member_fun>
+	static unique_ptr< RetType(MemberFunArgs...), closure_deleter > make_closure_for(ClassType *obj)
+	{
+		ffi_cif *cif = get_cif();
+		closure_allocator& a = closure_allocator::instance();
+		closure_allocator::slot *slot = a.allocate();
+		ffi_status status = closure_allocator::prepare(slot, cif, &dispatch<MemFun, member_fun>, obj);
+		if (status != FFI_OK)
+		{
+			a.deallocate(slot);
+			throw 1;  // FIXME: better thing to throw (or return null?)
+		}
+		RetType(*fp)(MemberFunArgs...) = reinterpret_cast<RetType(*)(MemberFunArgs...)>(slot->code);
+		return std::unique_ptr< RetType(MemberFunArgs...), closure_deleter >
+			(fp, closure_deleter(slot));
+	}
 	template <MemberFunPtrType member_fun>
 	static unique_ptr< RetType(MemberFunArgs...), closure_deleter > make_closure(ClassType *obj)
+	{ return make_closure_for<MemberFunPtrType, member_fun>(obj); }
+	template <ConstMemberFunPtrType member_fun>
+	static unique_ptr< RetType(MemberFunArgs...), closure_deleter > make_closure(ClassType *obj)
+	{ return make_closure_for<ConstMemberFunPtrType, member_fun>(obj); }
+
+	/* What a thunk jumps to: our member function, as a plain function. */
+	template <typename MemFun, MemFun member_fun>
+	static RetType direct_call(ClassType *obj, MemberFunArgs... args)
 	{
-		RetType(*fp)(MemberFunArgs...);
-		ffi_closure *closure = reinterpret_cast<ffi_closure*>(
-			ffi_closure_alloc(sizeof (ffi_closure), (void**) &fp)
-		);
-		ffi_status status;
-		auto p_atypes = make_unique<std::vector<ffi_type *> >(
-			(std::vector<ffi_type *>) {ffi_type_s<MemberFunArgs>::t()...}
-		);
-		auto p_cif = make_unique<ffi_cif>();
-		status = ffi_prep_cif(&*p_cif,
-			/* ffi_abi abi */ FFI_DEFAULT_ABI,
-			/*unsigned int nargs */ p_atypes->size(),
-			/* ffi_type *rtype */ ffi_type_s<RetType>::t(),
-			/* ffi_type **atypes */ p_atypes->empty() ? nullptr : &(*p_atypes)[0]
-		);
-		if (status != FFI_OK) throw 1; // FIXME: better thing to throw (or return null?)
-		status = ffi_prep_closure(closure, &*p_cif, &the_fun<member_fun>, obj);
-		if (status != FFI_OK) throw 1;  // FIXME: better thing to throw (or return null?)
-		return std::unique_ptr< RetType(MemberFunArgs...), closure_deleter >
-			(fp, closure_deleter(closure, std::move(p_atypes), std::move(p_cif)));
+#ifdef SRK31CXX_CLOSURE_STATS
+		closure_stats::scope counted(stats_site<MemFun, member_fun>());
+#endif
+		return (obj->*member_fun)(std::forward<MemberFunArgs>(args)...);
+	}
+
+	/* Like make_closure(), but where we can, skip libffi's generic call
+	 * path: calls go through a thunk straight to direct_call(). That's
+	 * possible on x86-64 and AArch64 Linux, when every argument is a
+	 * primitive, pointer or reference and the integer ones fit in registers
+	 * along with the object pointer. Otherwise, or if executable memory
+	 * can't be had, we quietly fall back to make_closure(). */
+	template <typename MemFun, MemFun member_fun>
+	static unique_ptr< RetType(MemberFunArgs...), closure_deleter > make_fast_closure_for(ClassType *obj)
+	{
+#ifdef SRK31CXX_CLOSURE_JIT
+		if (thunk_args<MemberFunArgs...>::ok
+			&& thunk_args<MemberFunArgs...>::int_regs + 1 <= thunk_allocator::max_int_args)
+		{
+			void *writable;
+			RetType (*target)(ClassType *, MemberFunArgs...) = &direct_call<MemFun, member_fun>;
+			void *code = thunk_allocator::instance().make(obj,
+				reinterpret_cast<void(*)()>(target), &writable);
+			if (code)
+			{
+				closure_deleter d;
+				d.thunk = writable;
+				return std::unique_ptr< RetType(MemberFunArgs...), closure_deleter >
+					(reinterpret_cast<RetType(*)(MemberFunArgs...)>(code), d);
+			}
+		}
+#endif
+		return make_closure_for<MemFun, member_fun>(obj);
+	}
+	template <MemberFunPtrType member_fun>
+	static unique_ptr< RetType(MemberFunArgs...), closure_deleter > make_fast_closure(ClassType *obj)
+	{ return make_fast_closure_for<MemberFunPtrType, member_fun>(obj); }
+	template <ConstMemberFunPtrType member_fun>
+	static unique_ptr< RetType(MemberFunArgs...), closure_deleter > make_fast_closure(ClassType *obj)
+	{ return make_fast_closure_for<ConstMemberFunPtrType, member_fun>(obj); }
+
+	/* Closures from a static_closure_pool of N trampolines for our
+	 * signature, shared by every class and member function with it. */
+	template <typename MemFun, MemFun member_fun>
+	static RetType erased_call(void *obj, MemberFunArgs... args)
+	{
+		return direct_call<MemFun, member_fun>(static_cast<ClassType *>(obj),
+			std::forward<MemberFunArgs>(args)...);
+	}
+	template <std::size_t N>
+	using static_closure_ptr = typename static_closure_pool< RetType(MemberFunArgs...), N >::ptr;
+	template <MemberFunPtrType member_fun, std::size_t N = 64>
+	static static_closure_ptr<N> make_static_closure(ClassType *obj)
+	{
+		return static_closure_pool< RetType(MemberFunArgs...), N >::make(obj,
+			&erased_call<MemberFunPtrType, member_fun>);
+	}
+	template <ConstMemberFunPtrType member_fun, std::size_t N = 64>
+	static static_closure_ptr<N> make_static_closure(ClassType *obj)
+	{
+		return static_closure_pool< RetType(MemberFunArgs...), N >::make(obj,
+			&erased_call<ConstMemberFunPtrType, member_fun>);
 	}
+
+	/* Closures for many objects at once, all calling the same member
+	 * function, e.g. to fill in a callback table for each of a set of
+	 * objects. Where make_fast_closure() would use a thunk, the thunks
+	 * are laid out in one block of their own, mapped once (or reused from
+	 * a freed table); otherwise the
+	 * libffi closures are taken from closure_allocator in one go. Either
+	 * way the lot is freed as a unit, with the table. */
+	class closure_table
+	{
+		typedef RetType (*fun_ptr)(MemberFunArgs...);
+		std::vector<fun_ptr> fps;
+		std::vector<closure_allocator::slot *> slots;
+		void *block_w, *block_x;
+		std::size_t block_len;
+		closure_table(const closure_table&) = delete;
+		closure_table& operator=(const closure_table&) = delete;
+	public:
+		closure_table() : block_w(nullptr), block_x(nullptr), block_len(0) {}
+		closure_table(closure_table&& o)
+		 : fps(std::move(o.fps)), slots(std::move(o.slots)),
+		   block_w(o.block_w), block_x(o.block_x), block_len(o.block_len)
+		{ o.fps.clear(); o.slots.clear(); o.block_w = o.block_x = nullptr; o.block_len = 0; }
+		closure_table& operator=(closure_table&& o)
+		{ closure_table tmp(std::move(o)); swap(tmp); return *this; }
+		~closure_table() { reset(); }
+		void swap(closure_table& o)
+		{
+			fps.swap(o.fps); slots.swap(o.slots);
+			std::swap(block_w, o.block_w); std::swap(block_x, o.block_x);
+			std::swap(block_len, o.block_len);
+		}
+		void reset()
+		{
+			if (!slots.empty()) closure_allocator::instance().deallocate(&slots[0], slots.size());
+#ifdef SRK31CXX_CLOSURE_JIT
+			if (block_len) thunk_allocator::instance().release_block(block_len, block_w, block_x);
+#endif
+			fps.clear(); slots.clear();
+			block_w = block_x = nullptr; block_len = 0;
+		}
+
+		std::size_t size() const { return fps.size(); }
+		fun_ptr operator[](std::size_t i) const { return fps[i]; }
+		const fun_ptr *data() const { return fps.data(); }
+		const fun_ptr *begin() const { return fps.data(); }
+		const fun_ptr *end() const { return fps.data() + fps.size(); }
+
+		/* 'obj(i)' gives the ith object. */
+		template <typename MemFun, MemFun member_fun, typename Objs>
+		void fill(std::size_t n, Objs obj)
+		{
+			fps.resize(n);
+			if (n == 0) return;
+#ifdef SRK31CXX_CLOSURE_JIT
+			if (thunk_args<MemberFunArgs...>::ok
+				&& thunk_args<MemberFunArgs...>::int_regs + 1 <= thunk_allocator::max_int_args)
+			{
+				std::size_t page = sysconf(_SC_PAGESIZE);
+				std::size_t len = (n * thunk_allocator::thunk_size + page - 1) / page * page;
+				if (thunk_allocator::instance().acquire_block(&len, &block_w, &block_x))
+				{
+					block_len = len;
+					RetType (*target)(ClassType *, MemberFunArgs...) = &direct_call<MemFun, member_fun>;
+					for (std::size_t i = 0; i < n; ++i)
+					{
+						std::size_t off = i * thunk_allocator::thunk_size;
+						thunk_allocator::emit(static_cast<char *>(block_w) + off,
+							static_cast<char *>(block_x) + off, obj(i),
+							reinterpret_cast<void(*)()>(target));
+						fps[i] = reinterpret_cast<fun_ptr>(static_cast<char *>(block_x) + off);
+					}
+					return;
+				}
+			}
+#endif
+			ffi_cif *cif = get_cif();
+			// only take the slots once allocate() has filled them: if it
+			// throws it has put back what it got, and we're left empty
+			std::vector<closure_allocator::slot *> got(n);
+			try { closure_allocator::instance().allocate(&got[0], n); }
+			catch (...) { fps.clear(); throw; }
+			slots.swap(got);
+			for (std::size_t i = 0; i < n; ++i)
+			{
+				ffi_status status = closure_allocator::prepare(slots[i], cif,
+					&dispatch<MemFun, member_fun>, obj(i));
+				if (status != FFI_OK)
+				{
+					reset();
+					throw 1;  // FIXME: better thing to throw (or return null?)
+				}
+				fps[i] = reinterpret_cast<fun_ptr>(slots[i]->code);
+			}
+		}
+	};
+	/* For an array of 'n' objects, or an array of 'n' pointers to them. */
+	template <MemberFunPtrType member_fun>
+	static closure_table make_closures(ClassType *objs, std::size_t n)
+	{ closure_table t; t.template fill<MemberFunPtrType, member_fun>(n, [objs](std::size_t i) { return &objs[i]; }); return t; }
+	template <MemberFunPtrType member_fun>
+	static closure_table make_closures(ClassType *const *objs, std::size_t n)
+	{ closure_table t; t.template fill<MemberFunPtrType, member_fun>(n, [objs](std::size_t i) { return objs[i]; }); return t; }
+	template <ConstMemberFunPtrType member_fun>
+	static closure_table make_closures(ClassType *objs, std::size_t n)
+	{ closure_table t; t.template fill<ConstMemberFunPtrType, member_fun>(n, [objs](std::size_t i) { return &objs[i]; }); return t; }
+	template <ConstMemberFunPtrType member_fun>
+	static closure_table make_closures(ClassType *const *objs, std::size_t n)
+	{ closure_table t; t.template fill<ConstMemberFunPtrType, member_fun>(n, [objs](std::size_t i) { return objs[i]; }); return t; }
+
+	/* Shared closures, via closure_cache: asking again for the same 'obj'
+	 * and member function gives the same function pointer, for as long as
+	 * anyone's still holding it. Made with make_fast_closure(). */
+	template <typename MemFun, MemFun member_fun>
+	static std::shared_ptr< RetType(MemberFunArgs...) > shared_closure_for(ClassType *obj)
+	{
+		return closure_cache< RetType(MemberFunArgs...) >::instance().get(obj,
+			reinterpret_cast<void(*)()>(&dispatch<MemFun, member_fun>),
+			[obj]() { return make_fast_closure_for<MemFun, member_fun>(obj); });
+	}
+	template <MemberFunPtrType member_fun>
+	static std::shared_ptr< RetType(MemberFunArgs...) > shared_closure(ClassType *obj)
+	{ return shared_closure_for<MemberFunPtrType, member_fun>(obj); }
+	template <ConstMemberFunPtrType member_fun>
+	static std::shared_ptr< RetType(MemberFunArgs...) > shared_closure(ClassType *obj)
+	{ return shared_closure_for<ConstMemberFunPtrType, member_fun>(obj); }
 };
 /* Convenience typedef: given a member function,
  * figure out which instance of ffi_closure_f we need. */
@@ -213,6 +1438,103 @@ struct member_fun_typedef< RetT (ClassT::*)(ArgTs...) >
 {
 	typedef ffi_closure_s<ClassT, RetT, ArgTs...> t;
 };
+template <typename RetT, typename ClassT, typename... ArgTs>
+struct member_fun_typedef< RetT (ClassT::*)(ArgTs...) const >
+{
+	typedef ffi_closure_s<ClassT, RetT, ArgTs...> t;
+};
+#ifdef __cpp_noexcept_function_type
+template <typename RetT, typename ClassT, typename... ArgTs>
+struct member_fun_typedef< RetT (ClassT::*)(ArgTs...) noexcept >
+{
+	typedef ffi_closure_s<ClassT, RetT, ArgTs...> t;
+};
+template <typename RetT, typename ClassT, typename... ArgTs>
+struct member_fun_typedef< RetT (ClassT::*)(ArgTs...) const noexcept >
+{
+	typedef ffi_closure_s<ClassT, RetT, ArgTs...> t;
+};
+#endif
+
+/* Closures over any callable: a lambda, a functor, a function pointer.
+ * The callable is moved into the closure's own slot, so it lives exactly
+ * as long as the closure and costs no allocation of its own, provided it
+ * fits in InlineSize bytes; that's checked at compile time. Give a bigger
+ * size if need be; each size has its own slabs.
+ *
+ *   auto fp = srk31::make_closure<int(int, void*)>(
+ *       [this](int fd, void *arg) { return on_event(fd, arg); });
+ */
+static const std::size_t default_closure_inline_size = 4 * sizeof (void*);
+
+/* Holds the callable, and gives ffi_closure_s a member function to call. */
+template <typename F, typename RetType, typename... Args>
+struct callable_box
+{
+	F f;
+	template <typename G>
+	callable_box(G&& g) : f(std::forward<G>(g)) {}
+	RetType call(Args... args) { return f(std::forward<Args>(args)...); }
+	static void destroy(void *p) { static_cast<callable_box *>(p)->~callable_box(); }
+};
+
+template <std::size_t InlineSize>
+struct inline_closure_deleter
+{
+	typedef basic_closure_allocator<InlineSize> allocator;
+	typename allocator::slot *slot;
+	void (*destroy)(void *);
+	inline_closure_deleter() : slot(nullptr), destroy(nullptr) {}
+	inline_closure_deleter(typename allocator::slot *slot, void (*destroy)(void *))
+	 : slot(slot), destroy(destroy) {}
+	template <typename FunPtr>
+	void operator()(FunPtr) const
+	{
+		if (!slot) return;
+		destroy(slot->storage);
+		allocator::instance().deallocate(slot);
+	}
+};
+
+template <typename Sig, std::size_t InlineSize = default_closure_inline_size>
+struct inline_closure_s
+{};
+template <typename RetType, typename... Args, std::size_t InlineSize>
+struct inline_closure_s<RetType(Args...), InlineSize>
+{
+	typedef std::unique_ptr< RetType(Args...), inline_closure_deleter<InlineSize> > ptr;
+
+	template <typename F>
+	static ptr make(F&& f)
+	{
+		typedef callable_box<typename std::decay<F>::type, RetType, Args...> box;
+		typedef basic_closure_allocator<InlineSize> allocator;
+		static_assert(sizeof (box) <= InlineSize,
+			"callable too big for the closure's inline storage; give a bigger InlineSize");
+		static_assert(alignof (box) <= alignof (std::max_align_t),
+			"callable too strictly aligned for the closure's inline storage");
+		allocator& a = allocator::instance();
+		typename allocator::slot *slot = a.allocate();
+		box *b;
+		try { b = new (slot->storage) box(std::forward<F>(f)); }
+		catch (...) { a.deallocate(slot); throw; }
+		ffi_status status = allocator::prepare(slot,
+			ffi_signature_s<RetType, Args...>::cif(),
+			&ffi_closure_s<box, RetType, Args...>::template the_fun<&box::call>, b);
+		if (status != FFI_OK)
+		{
+			box::destroy(b);
+			a.deallocate(slot);
+			throw 1;  // FIXME: better thing to throw (or return null?)
+		}
+		return ptr(reinterpret_cast<RetType(*)(Args...)>(slot->code),
+			inline_closure_deleter<InlineSize>(slot, &box::destroy));
+	}
+};
+
+template <typename Sig, std::size_t InlineSize = default_closure_inline_size, typename F>
+typename inline_closure_s<Sig, InlineSize>::ptr make_closure(F&& f)
+{ return inline_closure_s<Sig, InlineSize>::make(std::forward<F>(f)); }
 
 } /* end namespace srk31 */
 
@@ -252,6 +1574,9 @@ int main(void)
 	std::cout << "Called the function (doubling? no) and got " << (*fp)(42.0, false) << std::endl;
 	std::cout << "z is " << o.get_z() << std::endl;
 	std::cout << "Called the function (doubling? yes) and got " << (*fp)(42.0, true) << std::endl;
+	auto fast = srk31::ffi_closure_s<myclass, int, float, bool>::make_fast_closure<&myclass::myfunction>(&o);
+	std::cout << "Called the fast one (doubling? yes) and got " << (*fast)(21.0, true) << std::endl;
+	std::cout << "z is " << o.get_z() << std::endl;
 	return 0;
 }
 
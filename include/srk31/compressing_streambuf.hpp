@@ -0,0 +1,62 @@
+#ifndef SRK31_COMPRESSING_STREAMBUF_HPP_
+#define SRK31_COMPRESSING_STREAMBUF_HPP_
+
+#include <memory>
+#include <ostream>
+#include <srk31/async_streambuf.hpp>
+
+/* A streambuf that compresses what it's given on its way to another
+ * streambuf. It's an async_streambuf whose writer thread feeds one of
+ * boost::iostreams' compressors, so the compressing happens on that
+ * thread, not the producer's.
+ *
+ * To get compressed indented output, put one of these under an indenting
+ * stream, e.g.
+ *
+ *     std::ofstream f("dump.gz");
+ *     indenting_compressed_ostream<> s(f.rdbuf(), gzip_compression);
+ *
+ * (see indenting_ostream.hpp) or pass a pointer to one as a stream's
+ * sink. Call finish() (or destroy it) to complete the compressed data. */
+
+namespace srk31
+{
+	enum compression
+	{
+		gzip_compression,
+		zlib_compression,
+		bzip2_compression,
+		lzma_compression,
+		zstd_compression
+	};
+
+	/* The compressor chain, in a base so that it exists before the
+	 * async_streambuf that writes to it. */
+	struct compressing_chain_member
+	{
+		std::unique_ptr<std::streambuf> p_chain;
+		compressing_chain_member(std::streambuf *out, compression c, int level);
+	};
+
+	class compressing_streambuf : private compressing_chain_member, public async_streambuf
+	{
+	public:
+		/* A 'level' of -1 means the compressor's own default. For bzip2,
+		 * it's the block size, 1 to 9. */
+		compressing_streambuf(std::streambuf *out,
+			compression c = gzip_compression, int level = -1,
+			std::size_t capacity = async_streambuf::default_capacity,
+			async_full_policy policy = async_block);
+		compressing_streambuf(std::ostream& out,
+			compression c = gzip_compression, int level = -1,
+			std::size_t capacity = async_streambuf::default_capacity,
+			async_full_policy policy = async_block);
+		virtual ~compressing_streambuf();
+
+		/* Drain, then end the compressed data (e.g. write gzip's trailer)
+		 * and let go of the output. Nothing more may be written after. */
+		void finish();
+	};
+}
+
+#endif
@@ -7,6 +7,13 @@
 #include <cassert>
 #include <boost/iterator_adaptors.hpp>
 #include <memory>
+#include <algorithm>
+#include <type_traits>
+#include <cstddef>
+#include <numeric>
+#include <functional>
+#include <tuple>
+#include <stdexcept>
 
 namespace srk31
 {
@@ -24,6 +31,17 @@ struct concatenating_sequence;
  * of the mixin from the iterator actually do? -- we do want
  * our iterator to be derived from Iter. */
 
+/* The iterator doesn't keep its sequence alive: like any container's
+ * iterators, ours are only good while the sequence is. That way copying
+ * one is just copying a few words, with no reference count to bump. We
+ * also keep the end of the segment we're in, so that the usual increment
+ * is one comparison against that, and sequences are the same only if
+ * they're the same object.
+ *
+ * If Iter is random-access, so are we: the sequence keeps a running count
+ * of elements before each segment, so our position is an index into the
+ * whole thing, and jumping to another index is a binary search over the
+ * segments (or nothing much, if we stay in the one we're in). */
 template < typename Iter
          , typename MixerIn
          , typename Value = typename std::iterator_traits<Iter>::value_type
@@ -33,25 +51,32 @@ struct concatenating_iterator_mixin
 {
 private:
 	typedef concatenating_iterator_mixin<Iter, MixerIn, Value, Reference> self;
+	typedef concatenating_sequence<Iter, Value, Reference> sequence;
+	// not "difference_type", which would clash with Iter's in MixerIn
+	typedef typename std::iterator_traits<Iter>::difference_type offset_type;
 
-	std::shared_ptr<concatenating_sequence<Iter, Value, Reference> > p_sequence;
+	sequence *p_sequence;
 	unsigned m_currently_in;
+	Iter m_segment_end; // == p_sequence->m_ends[m_currently_in]
 	bool initially_at_beginning;
 	bool alloc_sequence;
 	
 public:
 	// constructors
-	concatenating_iterator_mixin() : p_sequence(), m_currently_in(0),
+	concatenating_iterator_mixin() : p_sequence(0), m_currently_in(0),
+	  m_segment_end(),
 	  initially_at_beginning(false),
 	  alloc_sequence(false)
 	{}
 	concatenating_iterator_mixin(self&& arg) 
 	: p_sequence(arg.p_sequence), m_currently_in(std::move(arg.m_currently_in)),
+	  m_segment_end(std::move(arg.m_segment_end)),
 	  initially_at_beginning(arg.initially_at_beginning),
 	  alloc_sequence(arg.alloc_sequence)
 	{}
 	concatenating_iterator_mixin(const self& arg) 
 	: p_sequence(arg.p_sequence), m_currently_in(arg.m_currently_in),
+	  m_segment_end(arg.m_segment_end),
 	  initially_at_beginning(arg.initially_at_beginning),
 	  alloc_sequence(arg.alloc_sequence)
 	{}	// one-sequence constructor
@@ -60,9 +85,11 @@ public:
 			concatenating_sequence<Iter, Value, Reference>
 		> p_seq,
 		Iter val, unsigned val_in)
-	 : p_sequence(p_seq), 
+	 : p_sequence(p_seq.get()), 
 	   m_currently_in(val_in),
-	   initially_at_beginning(p_seq->m_begins.size() > 0 && val == p_seq->m_begins.at(0))
+	   m_segment_end(p_seq->m_ends[val_in]),
+	   initially_at_beginning(p_seq->m_begins.size() > 0 && val == p_seq->m_begins[0]),
+	   alloc_sequence(false)
 	{
 		iter() = val;
 		canonicalize_position();
@@ -73,6 +100,7 @@ public:
 	{
 		this->p_sequence = arg.p_sequence;
 		this->m_currently_in = arg.m_currently_in;
+		this->m_segment_end = arg.m_segment_end;
 		this->initially_at_beginning = arg.initially_at_beginning;
 		this->alloc_sequence = arg.alloc_sequence;
 		iter() = arg.iter();
@@ -80,8 +108,9 @@ public:
 	}
 	self& operator=(self&& arg) // move assignment
 	{
-		this->p_sequence = std::move(arg.p_sequence);
+		this->p_sequence = arg.p_sequence;
 		this->m_currently_in = arg.m_currently_in;
+		this->m_segment_end = std::move(arg.m_segment_end);
 		this->initially_at_beginning = arg.initially_at_beginning;
 		this->alloc_sequence = arg.alloc_sequence;
 		iter() = std::move(arg.iter());
@@ -93,11 +122,13 @@ public:
 
 	// get the underlying sequence
 	std::shared_ptr<concatenating_sequence<Iter, Value, Reference> > 
-	get_sequence() { return p_sequence; }
+	get_sequence() { return p_sequence->shared_from_this(); }
 	// get the underlying sequence
 	std::shared_ptr<concatenating_sequence<Iter, Value, Reference> > 
-	get_sequence() const { return p_sequence; }
+	get_sequence() const { return p_sequence->shared_from_this(); }
 
+	// with iter(), our segmented-iterator interface: which segment
+	// we're in, and where in it
 	unsigned get_currently_in() const 
 	{ return m_currently_in; }
 
@@ -110,11 +141,13 @@ public:
 		// NOTE: this is tricky because sometimes our end() iterators
 		// will not be distinct. So we have to look at m_currently_in
 		// too.
+		if (this->iter() != m_segment_end) return;
 		
-		while (this->iter() == p_sequence->m_ends.at(m_currently_in)
+		while (this->iter() == m_segment_end
 			&& m_currently_in != p_sequence->m_ends.size() - 1)
 		{
-			this->iter() = p_sequence->m_begins.at(++m_currently_in);
+			this->iter() = p_sequence->m_begins[++m_currently_in];
+			m_segment_end = p_sequence->m_ends[m_currently_in];
 		}
 	}	
 
@@ -137,16 +170,33 @@ private:
 	void increment()
 	{
 		this->iter()++;
-		canonicalize_position();
+		if (this->iter() == m_segment_end) canonicalize_position();
 	}
 	void decrement()
 	{	
 		while (m_currently_in != 0 
-			&& this->iter() == p_sequence->m_begins.at(m_currently_in))
-		{ this->iter() = p_sequence->m_ends.at(--m_currently_in); }
+			&& this->iter() == p_sequence->m_begins[m_currently_in])
+		{ this->iter() = p_sequence->m_ends[--m_currently_in]; }
+		m_segment_end = p_sequence->m_ends[m_currently_in];
 		this->iter()--;
 		canonicalize_position();
 	}
+	offset_type index() const
+	{
+		return p_sequence->m_offsets[m_currently_in]
+			+ (this->iter() - p_sequence->m_begins[m_currently_in]);
+	}
+	void seek(offset_type pos)
+	{
+		// the last segment with pos elements or fewer before it is
+		// the one pos is in, or the last segment if pos is the end
+		const std::vector<offset_type>& offsets = p_sequence->m_offsets;
+		assert(pos >= 0 && pos <= offsets.back());
+		m_currently_in = std::upper_bound(offsets.begin(), offsets.end() - 1, pos)
+			- offsets.begin() - 1;
+		m_segment_end = p_sequence->m_ends[m_currently_in];
+		this->iter() = p_sequence->m_begins[m_currently_in] + (pos - offsets[m_currently_in]);
+	}
 public:
 	self& operator++() // prefix
 	{
@@ -170,12 +220,45 @@ public:
 		tmp.decrement();
 		return std::move(tmp);
 	}
+
+	// random access, only if Iter is
+	MixerIn& operator+=(offset_type n)
+	{
+		// staying short of the segment end, or not going back past its
+		// beginning, means we're still canonical
+		if (n >= 0 ? n < m_segment_end - this->iter()
+			: -n <= this->iter() - p_sequence->m_begins[m_currently_in])
+		{ this->iter() += n; }
+		else seek(index() + n);
+		return *static_cast<MixerIn *>(this);
+	}
+	MixerIn& operator-=(offset_type n) { return *this += -n; }
+	MixerIn operator+(offset_type n) const
+	{ MixerIn tmp = *static_cast<const MixerIn *>(this); tmp += n; return tmp; }
+	MixerIn operator-(offset_type n) const
+	{ MixerIn tmp = *static_cast<const MixerIn *>(this); tmp += -n; return tmp; }
+	offset_type operator-(const MixerIn& arg) const
+	{ return index() - arg.index(); }
+	Reference operator[](offset_type n) const
+	{ return *(*this + n); }
+	friend MixerIn operator+(offset_type n, const MixerIn& arg)
+	{ return arg + n; }
+	// not members, so that they beat Iter's own, which would need
+	// a conversion from MixerIn as much as ours would
+	friend bool operator<(const MixerIn& a, const MixerIn& b)
+	{ return a.index() < b.index(); }
+	friend bool operator>(const MixerIn& a, const MixerIn& b)
+	{ return b < a; }
+	friend bool operator<=(const MixerIn& a, const MixerIn& b)
+	{ return !(b < a); }
+	friend bool operator>=(const MixerIn& a, const MixerIn& b)
+	{ return !(a < b); }
 	
 private:
 	bool equal(const self& arg) const 
 	{ 
 		return this->iter() == arg.iter()
-		&& *(this->p_sequence) == *(arg.p_sequence)
+		&& this->p_sequence == arg.p_sequence
 		&& this->m_currently_in == arg.m_currently_in;
 	}
 public:
@@ -203,6 +286,11 @@ public:
 	using super::operator==;
 	using super::operator*;
 	using super::operator->;
+	using super::operator+=;
+	using super::operator-=;
+	using super::operator+;
+	using super::operator-;
+	using super::operator[];
 	// in  we borrow the copy constructor too
 	using super::operator=;
 	
@@ -224,24 +312,43 @@ struct concatenating_sequence
 
 	typedef concatenating_sequence<Iter, Value, Reference> self;
 	typedef Iter iterator;
+	typedef typename std::iterator_traits<Iter>::difference_type difference_type;
+	static const bool random_access = std::is_base_of<
+		std::random_access_iterator_tag,
+		typename std::iterator_traits<Iter>::iterator_category
+	>::value;
+
+	/* If Iter is random-access, m_offsets[i] is how many elements come
+	 * before segment i, with the total at the back. Otherwise it's empty. */
+	std::vector<difference_type> m_offsets;
 	
 	// default constructor
-	concatenating_sequence() : m_initialized(false) {}
+	concatenating_sequence() : m_initialized(false), m_offsets(random_access ? 1 : 0) {}
 
 	// one-sequence constructor
 	concatenating_sequence(Iter begin1, Iter end1)
-	 : m_initialized(true)
-	{ m_begins.push_back(begin1); m_ends.push_back(end1); }
+	 : m_initialized(true), m_offsets(random_access ? 1 : 0)
+	{ append(begin1, end1); }
 	// two-sequence constructor
 	concatenating_sequence(Iter begin1, Iter end1, Iter begin2, Iter end2)
-	 : m_initialized(true)
+	 : m_initialized(true), m_offsets(random_access ? 1 : 0)
 	{
-		m_begins.push_back(begin1); m_ends.push_back(end1); 
-		m_begins.push_back(begin2); m_ends.push_back(end2);
+		append(begin1, end1);
+		append(begin2, end2);
 	}
 	// should be copy-constructible by compiler
 
-	/* We can efficiently compute is_empty (but not size()). */
+	/* size() is O(1) if Iter is random-access, else a walk of each segment. */
+	std::size_t size() const
+	{
+		if (random_access) return m_offsets.back();
+		difference_type n = 0;
+		for (unsigned i = 0; i < m_begins.size(); ++i)
+		{ n += std::distance(m_begins[i], m_ends[i]); }
+		return n;
+	}
+
+	/* We can efficiently compute is_empty. */
 	bool is_empty() const
 	{
 		if (m_begins.size() == 0) return true;
@@ -261,12 +368,16 @@ struct concatenating_sequence
 		assert(m_ends.size() == m_begins.size());
 		return m_begins.size(); 
 	}
+	// segments, for algorithms that want to loop over each in turn
+	const Iter& segment_begin(unsigned i) const { return m_begins[i]; }
+	const Iter& segment_end(unsigned i) const { return m_ends[i]; }
 
 	// append utility, for building
 	self& append(Iter begin, Iter end)
 	{
 		m_begins.push_back(begin);
 		m_ends.push_back(end);
+		if (random_access) m_offsets.push_back(m_offsets.back() + std::distance(begin, end));
 		m_initialized = true;
 		//std::cerr << "Appended " << (begin == end ? "empty" : "nonempty") << " sequence" << std::endl;
 		return *this;
@@ -304,6 +415,383 @@ struct concatenating_sequence
 	}
 };
 
+/* A concatenation for when concatenating_sequence is too heavy: a view of
+ * up to N ranges that lives wherever you put it, typically on the stack.
+ * It holds its bounds inline, so building one and walking it never touches
+ * the heap, and its iterators are just a pointer back to it plus where
+ * they are, so copying one touches no reference count. As with
+ * concatenating_sequence's, they're only good while the view is, and
+ * copying the view doesn't bring them along. Appending an (N+1)th range
+ * throws std::length_error. */
+template <typename Iter, unsigned N = 4>
+class concatenating_view
+{
+	Iter m_begins[N];
+	Iter m_ends[N];
+	unsigned m_count;
+public:
+	class iterator
+	{
+		typedef typename std::iterator_traits<Iter>::iterator_category base_category;
+		friend class concatenating_view;
+
+		const concatenating_view *p_view;
+		unsigned m_currently_in;
+		Iter m_pos;
+		Iter m_segment_end;
+
+		iterator(const concatenating_view *p_view, unsigned in, Iter pos)
+		 : p_view(p_view), m_currently_in(in), m_pos(pos),
+		   m_segment_end(p_view->m_count ? p_view->m_ends[in] : pos)
+		{ canonicalize_position(); }
+		// as concatenating_iterator_mixin's
+		void canonicalize_position()
+		{
+			while (m_pos == m_segment_end && m_currently_in + 1 < p_view->m_count)
+			{
+				m_pos = p_view->m_begins[++m_currently_in];
+				m_segment_end = p_view->m_ends[m_currently_in];
+			}
+		}
+	public:
+		typedef typename std::conditional<
+			std::is_base_of<std::bidirectional_iterator_tag, base_category>::value,
+			std::bidirectional_iterator_tag,
+			base_category
+		>::type iterator_category;
+		typedef typename std::iterator_traits<Iter>::value_type value_type;
+		typedef typename std::iterator_traits<Iter>::difference_type difference_type;
+		typedef typename std::iterator_traits<Iter>::pointer pointer;
+		typedef typename std::iterator_traits<Iter>::reference reference;
+
+		iterator() : p_view(0), m_currently_in(0), m_pos(), m_segment_end() {}
+
+		reference operator*() const { return *m_pos; }
+		pointer operator->() const { return &*m_pos; }
+
+		iterator& operator++()
+		{
+			++m_pos;
+			if (m_pos == m_segment_end) canonicalize_position();
+			return *this;
+		}
+		iterator operator++(int) { iterator tmp = *this; ++*this; return tmp; }
+		iterator& operator--()
+		{
+			while (m_currently_in != 0 && m_pos == p_view->m_begins[m_currently_in])
+			{ m_pos = p_view->m_ends[--m_currently_in]; }
+			m_segment_end = p_view->m_ends[m_currently_in];
+			--m_pos;
+			return *this;
+		}
+		iterator operator--(int) { iterator tmp = *this; --*this; return tmp; }
+
+		// positions are canonical, so this is enough within one view
+		bool operator==(const iterator& arg) const
+		{ return m_pos == arg.m_pos && m_currently_in == arg.m_currently_in; }
+		bool operator!=(const iterator& arg) const { return !(*this == arg); }
+
+		// the segmented-iterator interface, as concatenating_iterator's
+		unsigned get_currently_in() const { return m_currently_in; }
+		const Iter& iter() const { return m_pos; }
+	};
+	typedef iterator const_iterator;
+
+	concatenating_view() : m_count(0) {}
+	concatenating_view(Iter begin1, Iter end1) : m_count(0)
+	{ append(begin1, end1); }
+	concatenating_view(Iter begin1, Iter end1, Iter begin2, Iter end2) : m_count(0)
+	{ append(begin1, end1); append(begin2, end2); }
+	concatenating_view(Iter begin1, Iter end1, Iter begin2, Iter end2, Iter begin3, Iter end3)
+	 : m_count(0)
+	{ append(begin1, end1); append(begin2, end2); append(begin3, end3); }
+
+	concatenating_view& append(Iter begin, Iter end)
+	{
+		if (m_count == N) throw std::length_error("concatenating_view is full");
+		m_begins[m_count] = begin;
+		m_ends[m_count] = end;
+		++m_count;
+		return *this;
+	}
+
+	unsigned subsequences_count() const { return m_count; }
+	const Iter& segment_begin(unsigned i) const { return m_begins[i]; }
+	const Iter& segment_end(unsigned i) const { return m_ends[i]; }
+	bool is_empty() const
+	{
+		for (unsigned i = 0; i < m_count; ++i) if (m_begins[i] != m_ends[i]) return false;
+		return true;
+	}
+
+	iterator begin() const
+	{ return iterator(this, 0, m_count ? m_begins[0] : Iter()); }
+	iterator end() const
+	{ return iterator(this, m_count ? m_count - 1 : 0, m_count ? m_ends[m_count - 1] : Iter()); }
+};
+
+/* What to hand out for an element of any of several iterators. If they
+ * all agree, that's it; if they're all lvalues of one type, one of them
+ * const, a const lvalue; otherwise a copy of their common_type. */
+template <typename... Refs> struct common_reference_of;
+template <typename Ref> struct common_reference_of<Ref> { typedef Ref type; };
+template <typename Ref1, typename Ref2, typename... Refs>
+struct common_reference_of<Ref1, Ref2, Refs...>
+{
+private:
+	typedef typename common_reference_of<Ref2, Refs...>::type rest;
+	typedef typename std::remove_cv<typename std::remove_reference<Ref1>::type>::type v1;
+	typedef typename std::remove_cv<typename std::remove_reference<rest>::type>::type v2;
+public:
+	typedef typename std::conditional<std::is_same<Ref1, rest>::value,
+		Ref1,
+		typename std::conditional<std::is_lvalue_reference<Ref1>::value
+				&& std::is_lvalue_reference<rest>::value && std::is_same<v1, v2>::value,
+			const v1&,
+			typename std::common_type<v1, v2>::type
+		>::type
+	>::type type;
+};
+
+/* A concatenation of ranges of different types, say a vector's, an array's
+ * and a deque's, without erasing their types. The bounds are in tuples,
+ * and the iterator keeps a position in each segment but only uses the one
+ * it's in; which one that is, is a number, but every operation turns it
+ * into a compile-time index with a run of ifs, so there's no indirect call
+ * per element. Non-owning, like concatenating_view: make one with
+ * concatenate(r1, r2, ...), and keep the ranges alive while you use it.
+ * The iterator is a forward iterator. For a whole pass, srk31::for_each(c, f)
+ * loops over each segment in turn, with no per-element dispatch at all. */
+template <typename... Iters>
+class concatenation
+{
+	static_assert(sizeof...(Iters) > 0, "concatenation of nothing");
+	static const unsigned N = sizeof...(Iters);
+	template <unsigned I> using index = std::integral_constant<unsigned, I>;
+
+	std::tuple<Iters...> m_begins;
+	std::tuple<Iters...> m_ends;
+
+	template <unsigned I, typename F>
+	void for_each_from(F& f, index<I>) const
+	{
+		for (auto p = std::get<I>(m_begins); p != std::get<I>(m_ends); ++p) f(*p);
+		for_each_from(f, index<I + 1>());
+	}
+	template <typename F> void for_each_from(F&, index<N>) const {}
+public:
+	typedef typename common_reference_of<
+		typename std::iterator_traits<Iters>::reference...
+	>::type reference;
+	typedef typename std::decay<reference>::type value_type;
+	typedef typename std::common_type<
+		typename std::iterator_traits<Iters>::difference_type...
+	>::type difference_type;
+
+	class iterator
+	{
+	public:
+		typedef std::forward_iterator_tag iterator_category;
+		typedef typename concatenation::value_type value_type;
+		typedef typename concatenation::difference_type difference_type;
+		typedef typename concatenation::reference reference;
+		// if reference is a value, there's no element to point at, so
+		// operator-> hands back a copy that can be pointed into
+		struct arrow_proxy
+		{
+			value_type v;
+			const value_type *operator->() const { return &v; }
+		};
+		typedef typename std::conditional<std::is_reference<reference>::value,
+			typename std::remove_reference<reference>::type *,
+			arrow_proxy
+		>::type pointer;
+	private:
+		friend class concatenation;
+		const concatenation *p_c;
+		unsigned m_currently_in;
+		std::tuple<Iters...> m_pos;
+
+		// move to the first element of segment I, or the first after it,
+		// or the end
+		template <unsigned I> void enter(index<I>)
+		{
+			m_currently_in = I;
+			std::get<I>(m_pos) = std::get<I>(p_c->m_begins);
+			if (std::get<I>(m_pos) == std::get<I>(p_c->m_ends)) enter(index<I + 1>());
+		}
+		void enter(index<N>) {}
+
+		template <unsigned I> reference deref(index<I>) const
+		{
+			return m_currently_in == I ? *std::get<I>(m_pos) : deref(index<I + 1>());
+		}
+		reference deref(index<N - 1>) const { return *std::get<N - 1>(m_pos); }
+
+		template <unsigned I> void increment(index<I>)
+		{
+			if (m_currently_in != I) increment(index<I + 1>());
+			else if (++std::get<I>(m_pos) == std::get<I>(p_c->m_ends)) enter(index<I + 1>());
+		}
+		void increment(index<N - 1>) { ++std::get<N - 1>(m_pos); }
+
+		template <unsigned I> bool equal(const iterator& arg, index<I>) const
+		{
+			return m_currently_in == I ? std::get<I>(m_pos) == std::get<I>(arg.m_pos)
+				: equal(arg, index<I + 1>());
+		}
+		bool equal(const iterator& arg, index<N - 1>) const
+		{ return std::get<N - 1>(m_pos) == std::get<N - 1>(arg.m_pos); }
+
+		pointer arrow(std::true_type) const { reference r = **this; return std::addressof(r); }
+		pointer arrow(std::false_type) const { return pointer{**this}; }
+
+		explicit iterator(const concatenation *p_c)
+		 : p_c(p_c), m_currently_in(0), m_pos(p_c->m_begins) {}
+	public:
+		iterator() : p_c(0), m_currently_in(0), m_pos() {}
+
+		reference operator*() const { return deref(index<0>()); }
+		pointer operator->() const { return arrow(std::is_reference<reference>()); }
+		iterator& operator++() { increment(index<0>()); return *this; }
+		iterator operator++(int) { iterator tmp = *this; ++*this; return tmp; }
+		bool operator==(const iterator& arg) const
+		{ return m_currently_in == arg.m_currently_in && equal(arg, index<0>()); }
+		bool operator!=(const iterator& arg) const { return !(*this == arg); }
+	};
+	typedef iterator const_iterator;
+
+	concatenation(const std::tuple<Iters...>& begins, const std::tuple<Iters...>& ends)
+	 : m_begins(begins), m_ends(ends) {}
+
+	iterator begin() const
+	{
+		iterator i(this);
+		i.enter(index<0>());
+		return i;
+	}
+	iterator end() const
+	{
+		iterator i(this);
+		i.m_currently_in = N - 1;
+		std::get<N - 1>(i.m_pos) = std::get<N - 1>(m_ends);
+		return i;
+	}
+
+	template <typename F> F for_each(F f) const
+	{
+		for_each_from(f, index<0>());
+		return f;
+	}
+};
+
+template <typename... Ranges>
+concatenation<decltype(std::begin(std::declval<Ranges&>()))...>
+concatenate(Ranges&... rs)
+{
+	return concatenation<decltype(std::begin(std::declval<Ranges&>()))...>(
+		std::make_tuple(std::begin(rs)...), std::make_tuple(std::end(rs)...));
+}
+
+template <typename... Iters, typename F>
+F for_each(const concatenation<Iters...>& c, F f)
+{ return c.for_each(f); }
+
+/* Segment-aware versions of some standard algorithms. Rather than test
+ * for a segment boundary at every element, they run the std algorithm
+ * over each segment's piece of [first, last) in turn, which for vector
+ * segments is a plain loop over memory that the compiler can unroll and
+ * vectorize. Found by ADL, and more specialised than the std ones, so
+ * an unqualified for_each(seq->begin(), seq->end(), f) gets these. */
+
+/* Call f(b, e, i) on each non-empty piece [b, e) of [first, last), which
+ * lies in segment i, for as long as f returns true. */
+template <typename Iter, typename Value, typename Reference, typename F>
+void for_each_segment(const concatenating_iterator<Iter, Value, Reference>& first,
+	const concatenating_iterator<Iter, Value, Reference>& last, F f)
+{
+	if (first == last) return;
+	auto p_seq = first.get_sequence();
+	const Iter *b = &first.iter();
+	unsigned i = first.get_currently_in();
+	for (; i != last.get_currently_in(); b = &p_seq->segment_begin(++i))
+	{
+		if (*b != p_seq->segment_end(i) && !f(*b, p_seq->segment_end(i), i)) return;
+	}
+	if (*b != last.iter()) f(*b, last.iter(), i);
+}
+
+template <typename Iter, typename Value, typename Reference, typename F>
+F for_each(const concatenating_iterator<Iter, Value, Reference>& first,
+	const concatenating_iterator<Iter, Value, Reference>& last, F f)
+{
+	for_each_segment(first, last, [&f](const Iter& b, const Iter& e, unsigned) {
+		std::for_each(b, e, std::ref(f));
+		return true;
+	});
+	return f;
+}
+
+template <typename Iter, typename Value, typename Reference, typename Out>
+Out copy(const concatenating_iterator<Iter, Value, Reference>& first,
+	const concatenating_iterator<Iter, Value, Reference>& last, Out out)
+{
+	for_each_segment(first, last, [&out](const Iter& b, const Iter& e, unsigned) {
+		out = std::copy(b, e, out);
+		return true;
+	});
+	return out;
+}
+
+template <typename Iter, typename Value, typename Reference, typename T>
+concatenating_iterator<Iter, Value, Reference>
+find(const concatenating_iterator<Iter, Value, Reference>& first,
+	const concatenating_iterator<Iter, Value, Reference>& last, const T& value)
+{
+	concatenating_iterator<Iter, Value, Reference> found = last;
+	for_each_segment(first, last, [&](const Iter& b, const Iter& e, unsigned i) {
+		Iter pos = std::find(b, e, value);
+		if (pos == e) return true;
+		found = first.get_sequence()->at(pos, i);
+		return false;
+	});
+	return found;
+}
+
+template <typename Iter, typename Value, typename Reference, typename T>
+typename std::iterator_traits<Iter>::difference_type
+count(const concatenating_iterator<Iter, Value, Reference>& first,
+	const concatenating_iterator<Iter, Value, Reference>& last, const T& value)
+{
+	typename std::iterator_traits<Iter>::difference_type n = 0;
+	for_each_segment(first, last, [&](const Iter& b, const Iter& e, unsigned) {
+		n += std::count(b, e, value);
+		return true;
+	});
+	return n;
+}
+
+template <typename Iter, typename Value, typename Reference, typename T, typename BinaryOp>
+T accumulate(const concatenating_iterator<Iter, Value, Reference>& first,
+	const concatenating_iterator<Iter, Value, Reference>& last, T init, BinaryOp op)
+{
+	for_each_segment(first, last, [&](const Iter& b, const Iter& e, unsigned) {
+		init = std::accumulate(b, e, std::move(init), op);
+		return true;
+	});
+	return init;
+}
+template <typename Iter, typename Value, typename Reference, typename T>
+T accumulate(const concatenating_iterator<Iter, Value, Reference>& first,
+	const concatenating_iterator<Iter, Value, Reference>& last, T init)
+{
+	for_each_segment(first, last, [&init](const Iter& b, const Iter& e, unsigned) {
+		init = std::accumulate(b, e, std::move(init));
+		return true;
+	});
+	return init;
+}
+
 } // end namespace srk31
 
 #endif
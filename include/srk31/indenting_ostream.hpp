@@ -6,87 +6,401 @@
 #include <stack>
 #include <string>
 #include <memory>
+#include <functional>
+#include <utility>
 #include <iostream>
 #include <cassert>
 #include <unistd.h>
-#include <boost/iostreams/concepts.hpp>    // input_filter
-#include <boost/iostreams/operations.hpp>  // get()
-#include <boost/iostreams/stream.hpp>
-#include <boost/iostreams/stream_buffer.hpp>
-#include <boost/iostreams/filtering_streambuf.hpp>
+#include <mutex>
+#include <thread>
+#include <climits>
+#include <sys/uio.h>
 #include <fileno.hpp>
-
-// namespace boost { namespace iostreams { class filtering_ostreambuf; } }
+#include <srk31/async_streambuf.hpp>
+#include <srk31/sink_streambufs.hpp>
+#include <srk31/compressing_streambuf.hpp>
 
 namespace srk31 {
 	// this class does all the work
-	struct newline_tabbing_filter;
-    
-    // this assumes the stream is a tty, so outputs control characters
-	class indenting_tty_ostream : public std::ostream
+	class indenting_streambuf : public std::streambuf
 	{
+		/* We write either to whatever streambuf 'target' currently has
+		 * (so that redirecting std::cout redirects us too) or, if
+		 * 'target' is null, to 'sink'. */
+		std::ostream *target;
+		std::streambuf *sink;
 		int indent_level;
-		newline_tabbing_filter *p_stream_filter;
-		boost::iostreams::filtering_ostreambuf *p_wrapped_streambuf;
+		/* Bytes are indented as they leave the put area, using the level
+		 * at that time. So we empty it before any change of level. */
+		char buf[1024];
+		/* ... unless we're writing straight to a file descriptor. Then we
+		 * use this bigger put area instead, and batch up iovecs for
+		 * writev(): runs of content point into the put area, which we
+		 * don't reuse until they've gone, and runs of indentation point
+		 * at a static string of tabs, so never get copied at all. */
+#ifdef IOV_MAX
+		static const int fd_batch_iovs = IOV_MAX;
+#else
+		static const int fd_batch_iovs = 1024;
+#endif
+		struct fd_batch
+		{
+			int fd;
+			int niov;
+			struct iovec iov[fd_batch_iovs];
+			char buf[65536];
+		};
+		std::unique_ptr<fd_batch> p_fd;
+		bool put_indented(const char *s, std::streamsize n);
+		bool drain_put_area();
+		bool write_iovs();
+		bool write_batch();
 	public:
-		indenting_tty_ostream(std::ostream& s = std::cout); 
-		virtual ~indenting_tty_ostream();
-		
-		int inc_level() { indent_level++; *this << '\t'; return indent_level; }
-		int dec_level() { indent_level--; *this << "\b\b\b\b\b\b\b\b"; return indent_level; }
-		int level() { return indent_level; }
+		indenting_streambuf(std::ostream& target);
+		indenting_streambuf(std::streambuf *sink);
+		/* The fd is not ours; we don't close it. */
+		explicit indenting_streambuf(int fd);
+		/* Takes over anything 'o' has pending. */
+		indenting_streambuf(indenting_streambuf&& o);
+		std::streambuf *get_sink() { return target ? target->rdbuf() : sink; }
+		bool writes_to_fd() const { return p_fd != nullptr; }
+		/* Not for use when writing to an fd. */
+		void set_sink(std::ostream& target);
+		void set_sink(std::streambuf *sink);
+		/* Like set_sink(), but what's pending stays pending, for the new sink. */
+		void rebind_sink(std::streambuf *sink) { this->target = 0; this->sink = sink; }
+		int level() const { return indent_level; }
+		void set_level(int level) { drain_put_area(); indent_level = level; }
+	protected:
+		virtual int_type overflow(int_type c);
+		virtual std::streamsize xsputn(const char *s, std::streamsize n);
+		virtual int sync();
 	};
-	/* support manipulators*/
-	inline indenting_tty_ostream& operator<<(indenting_tty_ostream& l,
-		std::function<indenting_tty_ostream&(indenting_tty_ostream&)> m)
-	{ m(l); return l; }
 
-	extern indenting_tty_ostream indenting_tty_cout, indenting_tty_cerr;
+	/* ... except in concurrent mode, where this one does. Each thread
+	 * writing to it gets its own indent level, starting at the level given
+	 * when we're made, its own line buffer and its own std::ostream front
+	 * end, and a line's indentation is applied when its first byte
+	 * arrives. Only whole lines (or, on a flush, whatever the flushing
+	 * thread has pending) go to the sink, each under a lock taken once per
+	 * line, so lines from different threads never mix.
+	 *
+	 * Each thread's state is in a table of ours, found through a
+	 * one-entry thread_local cache. It goes when the thread exits or
+	 * when we're destroyed, whichever is first, and any unflushed partial
+	 * line goes with it. */
+	class per_thread_indenting_streambuf : public std::streambuf
+	{
+		struct thread_state
+		{
+			int level;
+			/* The indentation owed after the last newline. It goes into
+			 * 'line' only with the next byte, so a flush never publishes
+			 * it on its own, ahead of another thread's line. */
+			int pending_indent;
+			std::string line;
+			std::ostream out;
+			thread_state(int level, std::streambuf *buf)
+			 : level(level), pending_indent(0), out(buf) {}
+		};
+		std::streambuf *sink;
+		std::mutex sink_lock;
+		unsigned long id;
+		int base_level;
+		std::map<std::thread::id, thread_state> states;
+		std::mutex states_lock;
+		thread_state& state();
+		void publish(thread_state& st);
+		friend struct per_thread_exit;
+		static void forget_thread(unsigned long id, std::thread::id t);
+	public:
+		per_thread_indenting_streambuf(std::streambuf *sink, int base_level = 0);
+		virtual ~per_thread_indenting_streambuf();
+		void set_sink(std::streambuf *s);
+		int get_base_level() const { return base_level; }
+		/* The calling thread's indent level. */
+		int& level() { return state().level; }
+		/* The calling thread's front end onto us. It has default formatting
+		 * to begin with, and lives as long as the thread's state does. */
+		std::ostream& stream() { return state().out; }
+	protected:
+		virtual int_type overflow(int_type c);
+		virtual std::streamsize xsputn(const char *s, std::streamsize n);
+		virtual int sync();
+	};
 
+	/* In capture mode, this one doesn't do the work at all, yet. It just
+	 * records text and level changes, unformatted, into an arena: the
+	 * put area is the current arena chunk, so writes land there directly.
+	 * The record is a preorder walk of the tree of levels, so a subtree
+	 * is a suffix of it, and dropping one is a rewind. Formatting only
+	 * happens if and when the record is replayed. */
+	class capture_streambuf : public std::streambuf
+	{
+		struct event
+		{
+			const char *text; // null for a level change
+			std::size_t len;
+			int delta;
+		};
+		struct mark
+		{
+			std::size_t nevents;
+			std::size_t chunk;
+			char *pos;
+			int level;
+		};
+		static const std::size_t chunk_size = 65536;
+		std::vector<std::unique_ptr<char[]> > chunks; // kept for reuse after a rewind
+		std::size_t cur_chunk;
+		std::vector<event> events;
+		std::vector<mark> open_levels; // one per inc not yet matched by a dec
+		int base_level;
+		int cur_level;
+		void seal();
+		mark here();
+		void rewind(const mark& m);
+	public:
+		capture_streambuf(int base_level);
+		int level() const { return cur_level; }
+		/* Record a level change and the marker written after it. A level
+		 * opened here begins after the marker, so discarding its subtree
+		 * keeps the marker. */
+		void change_level(int delta, const char *marker);
+		/* Forget everything since the innermost open level began (or since
+		 * capture began, if there isn't one). The level stays open. */
+		void discard_subtree();
+		/* Play everything back through 'out', starting at our base level. */
+		void replay(indenting_streambuf& out);
+	protected:
+		virtual int_type overflow(int_type c);
+		virtual int sync();
+	};
+
+	/* Everything about an indenting stream except what it writes when the
+	 * level changes. That is up to the policy; see below. */
+	class indenting_ostream_base : public std::ostream
+	{
+		indenting_streambuf m_buf;
+		/* Where we write when not async: an ostream, or failing that a streambuf. */
+		std::ostream *p_target;
+		std::streambuf *p_sink;
+		async_streambuf *p_async;
+		per_thread_indenting_streambuf *p_concurrent;
+		capture_streambuf *p_capture;
+		std::streambuf *active_buf()
+		{
+			if (p_capture) return p_capture;
+			if (p_concurrent) return p_concurrent;
+			return &m_buf;
+		}
+		std::streambuf *direct_sink() { return p_target ? p_target->rdbuf() : p_sink; }
+	protected:
+		indenting_ostream_base(std::ostream& s);
+		indenting_ostream_base(std::streambuf *sink);
+		indenting_ostream_base(int fd);
+		/* Moving takes over pending output and any async or concurrent
+		 * machinery; the moved-from stream is left writing nowhere new. */
+		indenting_ostream_base(indenting_ostream_base&& o);
+		virtual ~indenting_ostream_base();
+		/* For when our sink has moved, along with us. Not while async. */
+		void rebind_sink(std::streambuf *sink)
+		{ assert(!p_async); p_target = 0; p_sink = sink; m_buf.rebind_sink(sink);
+		  if (p_concurrent) p_concurrent->set_sink(sink); }
+		/* Change level, then write 'marker'. Returns the new level. */
+		int change_level(int delta, const char *marker)
+		{
+			if (p_capture) { p_capture->change_level(delta, marker); return p_capture->level(); }
+			int l;
+			if (p_concurrent) l = (p_concurrent->level() += delta);
+			else { m_buf.set_level(m_buf.level() + delta); l = m_buf.level(); }
+			thread_stream() << marker;
+			return l;
+		}
+	public:
+		/* Opt in to handing our (already indented) output to a writer
+		 * thread. See async_streambuf.hpp for what the policy means.
+		 * Streams writing to a bare fd ignore this. */
+		void set_async(async_full_policy policy = async_block,
+			std::size_t capacity = async_streambuf::default_capacity);
+		/* Go back to writing on the caller's thread, after a drain(). */
+		void set_sync();
+		/* Block until everything written so far has reached the target. */
+		void drain();
+		/* How many bytes the async_drop policy has thrown away since
+		 * set_async(); 0 if we're not async. */
+		unsigned long long dropped_bytes() { return p_async ? p_async->dropped_bytes() : 0; }
+		/* Opt in to (or out of) per-thread indentation, so that several
+		 * threads can write to us at once. Switch while only one thread
+		 * is using the stream. Every thread starts at the level we were at
+		 * when we switched, whatever we write to, and on switching back we
+		 * return to that level.
+		 *
+		 * Threads should write through thread_stream(), not through us:
+		 * any formatted insert writes the std::ostream's own state (it
+		 * resets width(), for one), so several threads inserting into the
+		 * one std::ostream race, however they leave the flags alone. Doing
+		 * that needs synchronization of the callers' own. */
+		void set_concurrent(bool concurrent = true);
+		/* In concurrent mode, the calling thread's own std::ostream onto us
+		 * (see per_thread_indenting_streambuf), good until the thread exits
+		 * or we leave concurrent mode; otherwise, just us. */
+		std::ostream& thread_stream() { return p_concurrent ? p_concurrent->stream() : *this; }
+
+		/* Capture mode: from now on, record what's written, and the level
+		 * changes, without formatting or writing anything. Not available
+		 * in concurrent mode. Capturing stops, and the record is dropped,
+		 * if the stream is destroyed. */
+		void begin_capture();
+		/* Cheaply forget the innermost subtree recorded so far; see
+		 * capture_streambuf::discard_subtree(). */
+		void discard_subtree();
+		/* Write out a copy of the record, formatted, and keep capturing. */
+		void render_capture(std::ostream& out);
+		/* Stop capturing. If 'render', the record goes to our own sink
+		 * first, as if it had been written normally. */
+		void end_capture(bool render = true);
+		bool capturing() const { return p_capture != 0; }
+
+		int level()
+		{
+			if (p_capture) return p_capture->level();
+			return p_concurrent ? p_concurrent->level() : m_buf.level();
+		}
+	};
+
+	/* Policies say what we write after changing level. Those that can be
+	 * decided at compile time are; the guessing one decides once, when
+	 * the stream is constructed. */
+
+    // this assumes the stream is a tty, so outputs control characters
+	struct tty_indent_policy
+	{
+		tty_indent_policy(std::ostream&) {}
+		tty_indent_policy(std::streambuf *) {}
+		tty_indent_policy(int) {}
+		static const char *inc_marker() { return "\t"; }
+		static const char *dec_marker() { return "\b\b\b\b\b\b\b\b"; }
+	};
 	// this doesn't assume a tty, but outputs an extra newlines on dec_level()
-	class indenting_newline_ostream : public std::ostream
+	struct newline_indent_policy
 	{
-		int indent_level;
-		newline_tabbing_filter *p_stream_filter;
-		boost::iostreams::filtering_ostreambuf *p_wrapped_streambuf;
+		newline_indent_policy(std::ostream&) {}
+		newline_indent_policy(std::streambuf *) {}
+		newline_indent_policy(int) {}
+		static const char *inc_marker() { return "\n"; }
+		static const char *dec_marker() { return "\n"; }
+	};
+	// this one guesses using isatty
+	struct guess_indent_policy
+	{
+		bool is_tty;
+		guess_indent_policy(std::ostream& s) : is_tty(isatty(fileno(s))) {}
+		// a bare streambuf might be anything; don't guess it's a tty
+		guess_indent_policy(std::streambuf *) : is_tty(false) {}
+		guess_indent_policy(int fd) : is_tty(isatty(fd)) {}
+		static const char *inc_marker() { return "\n"; }
+		const char *dec_marker() const
+		{ return is_tty ? tty_indent_policy::dec_marker() : newline_indent_policy::dec_marker(); }
+	};
+
+	template <typename Policy>
+	class basic_indenting_ostream : public indenting_ostream_base, private Policy
+	{
+		typedef basic_indenting_ostream<Policy> self;
 	public:
-		indenting_newline_ostream(std::ostream& s = std::cout); 
-		virtual ~indenting_newline_ostream();
-		
-		int inc_level() { indent_level++; *this << "\n"; return indent_level; }
-		int dec_level() { indent_level--; *this << "\n"; return indent_level; }
-		int level() { return indent_level; }
-	}; 
-	/* support manipulators*/
-	inline indenting_newline_ostream& operator<<(indenting_newline_ostream& l,
-		std::function<indenting_newline_ostream&(indenting_newline_ostream&)> m)
-	{ m(l); return l; }
-    
-    // this one guesses using isatty
-    class indenting_ostream : public std::ostream
-    {
-		int indent_level;
-		newline_tabbing_filter *p_stream_filter;
-		boost::iostreams::filtering_ostreambuf *p_wrapped_streambuf;
+		basic_indenting_ostream(std::ostream& s = std::cout)
+		 : indenting_ostream_base(s), Policy(s) {}
+		basic_indenting_ostream(std::streambuf *sink)
+		 : indenting_ostream_base(sink), Policy(sink) {}
+		/* Write straight to 'fd' with writev(), bypassing any std::streambuf
+		 * below us. We don't close it. */
+		explicit basic_indenting_ostream(int fd)
+		 : indenting_ostream_base(fd), Policy(fd) {}
+		basic_indenting_ostream(self&& o)
+		 : indenting_ostream_base(std::move(o)), Policy(static_cast<Policy&&>(o)) {}
+
+		int inc_level() { return change_level(1, Policy::inc_marker()); }
+		int dec_level() { return change_level(-1, Policy::dec_marker()); }
+
+		/* support manipulators*/
+		friend self& operator<<(self& l, std::function<self&(self&)> m)
+		{ m(l); return l; }
+	};
+
+	typedef basic_indenting_ostream<tty_indent_policy> indenting_tty_ostream;
+	typedef basic_indenting_ostream<newline_indent_policy> indenting_newline_ostream;
+	typedef basic_indenting_ostream<guess_indent_policy> indenting_ostream;
+
+	/* An indenting stream that carries its sink around inside it, e.g.
+	 * a fixed_buffer_streambuf or a string_sink_streambuf. Nothing is
+	 * allocated to construct, use or move one, so they can be made on
+	 * the stack for rendering something into a buffer or string. */
+	template <typename Sinkbuf>
+	struct indenting_sink_member
+	{
+		Sinkbuf m_sink;
+		template <typename... Args>
+		indenting_sink_member(Args&&... args) : m_sink(std::forward<Args>(args)...) {}
+		indenting_sink_member(indenting_sink_member&& o) : m_sink(std::move(o.m_sink)) {}
+	};
+	template <typename Sinkbuf, typename Policy = newline_indent_policy>
+	class basic_indenting_sink_ostream
+	 : private indenting_sink_member<Sinkbuf>, public basic_indenting_ostream<Policy>
+	{
+		typedef basic_indenting_sink_ostream<Sinkbuf, Policy> self;
+		typedef indenting_sink_member<Sinkbuf> member;
 	public:
-		indenting_ostream(std::ostream& s = std::cout); 
-		virtual ~indenting_ostream();
-		
-		int inc_level() { indent_level++; *this << "\n"; return indent_level; }
-		int dec_level() { indent_level--; 
-        	if (isatty(fileno(*this))) *this << "\b\b\b\b\b\b\b\b";
-            else *this << "\n";
-            return indent_level; }
-		int level() { return indent_level; }
-    };
-	/* support manipulators*/
-	inline indenting_ostream& operator<<(indenting_ostream& l,
-		std::function<indenting_ostream&(indenting_ostream&)> m)
-	{ m(l); return l; }
-
-
-	extern indenting_ostream indenting_cout;
-    extern indenting_ostream indenting_cerr;
+		template <typename... Args>
+		explicit basic_indenting_sink_ostream(Args&&... args)
+		 : member(std::forward<Args>(args)...),
+		   basic_indenting_ostream<Policy>(&this->m_sink) {}
+		basic_indenting_sink_ostream(self&& o)
+		 : member(static_cast<member&&>(o)),
+		   basic_indenting_ostream<Policy>(static_cast<basic_indenting_ostream<Policy>&&>(o))
+		{ this->rebind_sink(&this->m_sink); }
+		virtual ~basic_indenting_sink_ostream() { this->flush(); }
+
+		Sinkbuf& sink() { return this->m_sink; }
+	};
+	template <typename Policy = newline_indent_policy>
+	using indenting_fixed_buffer_ostream = basic_indenting_sink_ostream<fixed_buffer_streambuf, Policy>;
+	template <typename String = std::string, typename Policy = newline_indent_policy>
+	using indenting_string_ostream
+	 = basic_indenting_sink_ostream<basic_string_sink_streambuf<String>, Policy>;
+	/* Compresses on a separate thread; see compressing_streambuf.hpp.
+	 * Not movable. */
+	template <typename Policy = newline_indent_policy>
+	using indenting_compressed_ostream = basic_indenting_sink_ostream<compressing_streambuf, Policy>;
+
+	extern template class basic_indenting_ostream<tty_indent_policy>;
+	extern template class basic_indenting_ostream<newline_indent_policy>;
+	extern template class basic_indenting_ostream<guess_indent_policy>;
+
+	/* The standard streams, indenting. Each is made the first time its
+	 * accessor is called, so a program that never asks for them never
+	 * makes them, and static constructors anywhere can use them safely.
+	 * They're destroyed, so flushed, before std::cout and std::cerr. */
+	indenting_tty_ostream& get_indenting_tty_cout();
+	indenting_tty_ostream& get_indenting_tty_cerr();
+	indenting_newline_ostream& get_indenting_newline_cout();
+	indenting_newline_ostream& get_indenting_newline_cerr();
+	indenting_ostream& get_indenting_cout();
+	indenting_ostream& get_indenting_cerr();
+
+	/* The old names, as references bound through the accessors. Each file
+	 * including this header binds its own, before any of its other static
+	 * constructors run, and so makes the streams then. Define
+	 * SRK31_NO_INDENTING_STREAM_NAMES to go without them, and make the
+	 * streams only if and when the accessors are called. */
+#ifndef SRK31_NO_INDENTING_STREAM_NAMES
+	static indenting_tty_ostream& indenting_tty_cout = get_indenting_tty_cout();
+	static indenting_tty_ostream& indenting_tty_cerr = get_indenting_tty_cerr();
+	static indenting_newline_ostream& indenting_newline_cout = get_indenting_newline_cout();
+	static indenting_newline_ostream& indenting_newline_cerr = get_indenting_newline_cerr();
+	static indenting_ostream& indenting_cout = get_indenting_cout();
+	static indenting_ostream& indenting_cerr = get_indenting_cerr();
+#endif
 }
 
 #endif
@@ -0,0 +1,200 @@
+#ifndef SRK31_MERGING_ITERATOR_HPP_
+#define SRK31_MERGING_ITERATOR_HPP_
+
+#include <iterator>
+#include <vector>
+#include <functional>
+#include <utility>
+#include <cstddef>
+
+namespace srk31
+{
+
+template <typename Iter, typename Compare>
+struct merging_sequence;
+
+/* concatenating_sequence's sibling: given k sorted runs, the iterator
+ * yields all their elements in order, without copying or sorting them.
+ * The runs are appended to a merging_sequence just as segments are to a
+ * concatenating_sequence, which has to outlive its iterators; but nothing
+ * here needs it to be owned by a shared_ptr.
+ *
+ * The iterator keeps a position in each run and a loser tree over them:
+ * m_tree[0] is the run whose element is next, and each internal node
+ * m_tree[1..k-1] the run that lost the match there. Leaf i is node k + i.
+ * So stepping past an element replays one path of log k matches. Ties go
+ * to the earlier run, so the merge is stable. That's all the state, O(k).
+ *
+ * copy_block() is the batch mode. Once a run has won twice running,
+ * we find the run that will take over from it -- the best of those it beat
+ * on its way up -- then emit its elements for as long as they still win
+ * against that one, one comparison each, and replay the tree only when we
+ * stop. On runs that interleave in long stretches that's most of the
+ * work saved; merge_into() does a whole merge that way.
+ *
+ * Unlike concatenating_iterator, this isn't a mixin derived from Iter.
+ * A concatenating iterator is always in one segment, so its position is
+ * one Iter and the mixin can keep it in the Iter base. We hold a position
+ * in every run, and which one is current changes from step to step, so an
+ * Iter base would just be one more copy to swap in and out each time the
+ * winner changes. It would also rule out plain pointers as run iterators.
+ * We still offer the same segmented-iterator interface: iter() is the
+ * current run's position and get_currently_in() the run's index. */
+template <typename Iter, typename Compare>
+class merging_iterator
+{
+	typedef merging_iterator<Iter, Compare> self;
+	typedef merging_sequence<Iter, Compare> sequence;
+	friend struct merging_sequence<Iter, Compare>;
+
+	sequence *p_sequence;
+	// both empty for end()
+	std::vector<Iter> m_pos;
+	std::vector<unsigned> m_tree;
+
+	bool exhausted(unsigned run) const
+	{ return m_pos[run] == p_sequence->m_ends[run]; }
+	// does run a's next element come out before run b's?
+	bool beats(unsigned a, unsigned b) const
+	{
+		if (exhausted(a)) return false;
+		if (exhausted(b)) return true;
+		if (p_sequence->m_comp(*m_pos[a], *m_pos[b])) return true;
+		if (p_sequence->m_comp(*m_pos[b], *m_pos[a])) return false;
+		return a < b;
+	}
+	// play the matches below 'node', returning the winner
+	unsigned build(unsigned node)
+	{
+		unsigned k = m_pos.size();
+		if (node >= k) return node - k;
+		unsigned l = build(2 * node);
+		unsigned r = build(2 * node + 1);
+		if (beats(l, r)) { m_tree[node] = r; return l; }
+		else { m_tree[node] = l; return r; }
+	}
+	// run w's next element has changed: replay its path to the root
+	void replay(unsigned w)
+	{
+		unsigned k = m_pos.size();
+		for (unsigned node = (w + k) / 2; node > 0; node /= 2)
+		{
+			if (beats(m_tree[node], w)) std::swap(m_tree[node], w);
+		}
+		m_tree[0] = w;
+	}
+
+	explicit merging_iterator(sequence *p_seq) : p_sequence(p_seq) {}
+public:
+	typedef std::forward_iterator_tag iterator_category;
+	typedef typename std::iterator_traits<Iter>::value_type value_type;
+	typedef typename std::iterator_traits<Iter>::difference_type difference_type;
+	typedef typename std::iterator_traits<Iter>::pointer pointer;
+	typedef typename std::iterator_traits<Iter>::reference reference;
+
+	merging_iterator() : p_sequence(0) {}
+
+	bool at_end() const
+	{ return m_pos.empty() || exhausted(m_tree[0]); }
+	// which run the current element is from
+	unsigned get_currently_in() const { return m_tree[0]; }
+	const Iter& iter() const { return m_pos[m_tree[0]]; }
+
+	reference operator*() const { return *iter(); }
+	pointer operator->() const { return &*iter(); }
+
+	self& operator++()
+	{
+		unsigned w = m_tree[0];
+		++m_pos[w];
+		replay(w);
+		return *this;
+	}
+	self operator++(int) { self tmp = *this; ++*this; return tmp; }
+
+	/* Write out up to max elements, at most as many as come from the
+	 * current run before another takes over, advancing past them. Until
+	 * at_end(), always writes at least one. */
+	template <typename Out>
+	Out copy_block(Out out, std::size_t max = std::size_t(-1))
+	{
+		if (at_end() || max == 0) return out;
+		unsigned w = m_tree[0];
+		unsigned k = m_pos.size();
+		if (k == 1)
+		{
+			for (; max > 0 && !exhausted(w); --max) *out++ = *m_pos[w]++;
+			return out;
+		}
+		// one element as usual; only if the same run wins again is it
+		// worth finding its challenger, else runs that take turns
+		// element by element would pay for that every time
+		*out++ = *m_pos[w]++;
+		replay(w);
+		if (--max == 0 || m_tree[0] != w) return out;
+		unsigned node = (w + k) / 2;
+		unsigned next = m_tree[node];
+		for (node /= 2; node > 0; node /= 2)
+		{
+			if (beats(m_tree[node], next)) next = m_tree[node];
+		}
+		for (; max > 0 && beats(w, next); --max) *out++ = *m_pos[w]++;
+		replay(w);
+		return out;
+	}
+
+	// positions are canonical: a given winner at a given place happens once
+	bool operator==(const self& arg) const
+	{
+		if (at_end() || arg.at_end()) return at_end() == arg.at_end();
+		return p_sequence == arg.p_sequence && m_tree[0] == arg.m_tree[0]
+			&& iter() == arg.iter();
+	}
+	bool operator!=(const self& arg) const { return !(*this == arg); }
+};
+
+template <typename Iter,
+	typename Compare = std::less<typename std::iterator_traits<Iter>::value_type> >
+struct merging_sequence
+{
+	std::vector<Iter> m_begins;
+	std::vector<Iter> m_ends;
+	Compare m_comp;
+
+	typedef merging_sequence<Iter, Compare> self;
+	typedef merging_iterator<Iter, Compare> iterator;
+
+	explicit merging_sequence(Compare comp = Compare()) : m_comp(comp) {}
+
+	// each run must be sorted by m_comp
+	self& append(Iter begin, Iter end)
+	{
+		m_begins.push_back(begin);
+		m_ends.push_back(end);
+		return *this;
+	}
+	unsigned subsequences_count() const { return m_begins.size(); }
+
+	iterator begin()
+	{
+		iterator i(this);
+		if (m_begins.empty()) return i;
+		i.m_pos = m_begins;
+		i.m_tree.resize(m_begins.size());
+		i.m_tree[0] = i.build(1);
+		return i;
+	}
+	iterator end() { return iterator(this); }
+
+	// the whole merge, a block at a time
+	template <typename Out>
+	Out merge_into(Out out)
+	{
+		for (iterator i = begin(); !i.at_end(); ) out = i.copy_block(out);
+		return out;
+	}
+};
+
+} // end namespace srk31
+
+#endif
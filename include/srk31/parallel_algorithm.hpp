@@ -0,0 +1,126 @@
+#ifndef SRK31_PARALLEL_ALGORITHM_HPP_
+#define SRK31_PARALLEL_ALGORITHM_HPP_
+
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <iterator>
+#include <functional>
+#include <cstddef>
+#include <srk31/concatenating_iterator.hpp>
+#include <srk31/thread_pool.hpp>
+
+/* Parallel walks of a concatenating_sequence, e.g. of per-thread result
+ * vectors joined with append(). The sequence is cut into pieces, which
+ * a thread_pool then works through, each piece with the segment-aware
+ * loops from concatenating_iterator.hpp.
+ *
+ * If the segments are random-access, the pieces are equal runs of
+ * elements, a few per thread, crossing segment boundaries as need be, so
+ * one huge segment is shared out and lots of tiny ones are lumped
+ * together. Otherwise, we can't know the lengths without walking them,
+ * so each non-empty segment is a piece.
+ *
+ * Results are as from a serial walk of begin() .. end(), as long as
+ * transform_reduce's reduce is associative: partial results are combined
+ * in sequence order. parallel_for_each's f is called concurrently, so it
+ * had better be safe to. */
+
+namespace srk31
+{
+	template <typename Iter, typename Value, typename Reference>
+	void add_parallel_pieces(concatenating_sequence<Iter, Value, Reference>& seq, unsigned nthreads,
+		std::vector< std::pair< concatenating_iterator<Iter, Value, Reference>,
+			concatenating_iterator<Iter, Value, Reference> > >& pieces,
+		std::random_access_iterator_tag)
+	{
+		typedef concatenating_iterator<Iter, Value, Reference> iterator;
+		// not much less than this per piece, or threads cost more than they save
+		const std::size_t min_piece = 4096;
+
+		std::size_t total = seq.size();
+		std::size_t npieces = std::min<std::size_t>(nthreads * 4,
+			(total + min_piece - 1) / min_piece);
+		iterator b = seq.begin();
+		for (std::size_t i = 1; i <= npieces; ++i)
+		{
+			iterator e = seq.begin() + (total * i / npieces);
+			pieces.push_back(std::make_pair(b, e));
+			b = e;
+		}
+	}
+	template <typename Iter, typename Value, typename Reference>
+	void add_parallel_pieces(concatenating_sequence<Iter, Value, Reference>& seq, unsigned,
+		std::vector< std::pair< concatenating_iterator<Iter, Value, Reference>,
+			concatenating_iterator<Iter, Value, Reference> > >& pieces,
+		std::input_iterator_tag)
+	{
+		for (unsigned i = 0; i < seq.subsequences_count(); ++i)
+		{
+			if (seq.segment_begin(i) == seq.segment_end(i)) continue;
+			pieces.push_back(std::make_pair(seq.at(seq.segment_begin(i), i),
+				seq.at(seq.segment_end(i), i)));
+		}
+	}
+	template <typename Iter, typename Value, typename Reference>
+	std::vector< std::pair< concatenating_iterator<Iter, Value, Reference>,
+		concatenating_iterator<Iter, Value, Reference> > >
+	parallel_pieces(concatenating_sequence<Iter, Value, Reference>& seq, unsigned nthreads)
+	{
+		std::vector< std::pair< concatenating_iterator<Iter, Value, Reference>,
+			concatenating_iterator<Iter, Value, Reference> > > pieces;
+		if (!seq.is_empty()) add_parallel_pieces(seq, nthreads, pieces,
+			typename std::iterator_traits<Iter>::iterator_category());
+		return pieces;
+	}
+
+	template <typename Iter, typename Value, typename Reference, typename F>
+	void parallel_for_each(concatenating_sequence<Iter, Value, Reference>& seq, F f,
+		thread_pool& pool = thread_pool::instance())
+	{
+		auto pieces = parallel_pieces(seq, pool.concurrency());
+		pool.run(pieces.size(), [&](std::size_t i) {
+			for_each_segment(pieces[i].first, pieces[i].second,
+				[&f](const Iter& b, const Iter& e, unsigned) {
+					for (Iter p = b; p != e; ++p) f(*p);
+					return true;
+				});
+		});
+	}
+
+	template <typename Iter, typename Value, typename Reference,
+		typename T, typename Reduce, typename Transform>
+	T parallel_transform_reduce(concatenating_sequence<Iter, Value, Reference>& seq,
+		T init, Reduce reduce, Transform transform,
+		thread_pool& pool = thread_pool::instance())
+	{
+		auto pieces = parallel_pieces(seq, pool.concurrency());
+		// no identity to start each piece from, so start from its first element
+		std::vector<T> partials(pieces.size(), init);
+		pool.run(pieces.size(), [&](std::size_t i) {
+			bool started = false;
+			T& acc = partials[i];
+			for_each_segment(pieces[i].first, pieces[i].second,
+				[&](const Iter& b, const Iter& e, unsigned) {
+					Iter p = b;
+					if (!started) { acc = transform(*p++); started = true; }
+					for (; p != e; ++p) acc = reduce(std::move(acc), transform(*p));
+					return true;
+				});
+		});
+		for (auto& partial : partials) init = reduce(std::move(init), std::move(partial));
+		return init;
+	}
+
+	template <typename Iter, typename Value, typename Reference, typename Pred>
+	typename std::iterator_traits<Iter>::difference_type
+	parallel_count_if(concatenating_sequence<Iter, Value, Reference>& seq, Pred pred,
+		thread_pool& pool = thread_pool::instance())
+	{
+		typedef typename std::iterator_traits<Iter>::difference_type count_type;
+		return parallel_transform_reduce(seq, count_type(0), std::plus<count_type>(),
+			[&pred](Reference x) -> count_type { return pred(x) ? 1 : 0; }, pool);
+	}
+}
+
+#endif
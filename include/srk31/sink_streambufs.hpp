@@ -0,0 +1,59 @@
+#ifndef SRK31_SINK_STREAMBUFS_HPP_
+#define SRK31_SINK_STREAMBUFS_HPP_
+
+#include <streambuf>
+#include <string>
+#include <cstddef>
+
+/* Streambufs that put their output somewhere the caller already owns,
+ * so that writing through them never allocates on our account. Both are
+ * movable, so they can live inside a movable stream. */
+
+namespace srk31
+{
+	/* Writes into a caller-supplied buffer. The buffer *is* our put area,
+	 * so there's no copying beyond the write itself. Once the buffer is
+	 * full, writes fail (and a stream over us goes bad); what fitted
+	 * stays put. */
+	class fixed_buffer_streambuf : public std::streambuf
+	{
+	public:
+		fixed_buffer_streambuf(char *buf, std::size_t len)
+		{ setp(buf, buf + len); }
+		fixed_buffer_streambuf(fixed_buffer_streambuf&& o)
+		 : std::streambuf(o)
+		{ o.setp(0, 0); }
+
+		const char *data() const { return pbase(); }
+		std::size_t size() const { return pptr() - pbase(); }
+		bool full() const { return pptr() == epptr(); }
+		/* Start again from the beginning of the same buffer. */
+		void reset() { setp(pbase(), epptr()); }
+	};
+
+	/* Appends to a caller-supplied string. Use a string type with an arena
+	 * allocator, and the only memory we touch comes from the arena. */
+	template <typename String = std::string>
+	class basic_string_sink_streambuf : public std::streambuf
+	{
+		String *p_str;
+	public:
+		basic_string_sink_streambuf(String& s) : p_str(&s) {}
+		basic_string_sink_streambuf(basic_string_sink_streambuf&& o)
+		 : std::streambuf(o), p_str(o.p_str) {}
+
+		String& str() { return *p_str; }
+	protected:
+		virtual std::streamsize xsputn(const char *s, std::streamsize n)
+		{ p_str->append(s, n); return n; }
+		virtual int_type overflow(int_type c)
+		{
+			if (!traits_type::eq_int_type(c, traits_type::eof()))
+			{ p_str->push_back(traits_type::to_char_type(c)); }
+			return traits_type::not_eof(c);
+		}
+	};
+	typedef basic_string_sink_streambuf<> string_sink_streambuf;
+}
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef SRK31_THREAD_POOL_HPP_
+#define SRK31_THREAD_POOL_HPP_
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <exception>
+#include <cstddef>
+
+/* A fixed set of worker threads for splitting a loop across. run(n, f)
+ * calls f(0) .. f(n-1), each exactly once, on the workers and on the
+ * calling thread, and returns when they're all done. Indices are handed
+ * out one at a time as threads come free, so if some calls are slower
+ * than others, the rest of the work goes to whoever is idle.
+ *
+ * One run() at a time per pool; others wait their turn. A run() from
+ * inside f, on any pool, just loops on the calling thread, rather than
+ * wait for workers who are busy running us. If an f throws, run()
+ * rethrows the first exception once the others have finished, and
+ * indices not yet handed out are skipped. */
+
+namespace srk31
+{
+	class thread_pool
+	{
+		std::vector<std::thread> workers;
+
+		std::mutex m;
+		std::condition_variable work_ready;
+		std::condition_variable work_done;
+		/* The current run. 'generation' counts runs, so each worker
+		 * can tell a new one from the one it has already done. */
+		const std::function<void(std::size_t)> *job;
+		std::size_t njobs;
+		std::atomic<std::size_t> next;
+		unsigned long long generation;
+		unsigned busy;
+		std::exception_ptr failure;
+		bool stopping;
+
+		std::mutex run_lock;
+
+		void work();
+		void worker_loop();
+	public:
+		/* Zero workers is fine: everything runs on the caller. */
+		explicit thread_pool(unsigned nworkers);
+		~thread_pool();
+
+		/* How many threads a run() uses, counting the caller. */
+		unsigned concurrency() const { return workers.size() + 1; }
+		void run(std::size_t n, const std::function<void(std::size_t)>& f);
+
+		/* One worker per hardware thread, less one for the caller.
+		 * Never destroyed, so it can be used until exit. */
+		static thread_pool& instance();
+	};
+}
+
+#endif
@@ -0,0 +1,172 @@
+#include <srk31/async_streambuf.hpp>
+#include <algorithm>
+#include <cstring>
+
+namespace srk31
+{
+	async_streambuf::async_streambuf(std::streambuf *target,
+		std::size_t capacity, async_full_policy policy)
+	 : target(target), policy(policy), ring(capacity ? capacity : 1),
+	   head(0), tail(0), dropped(0), syncs_requested(0), syncs_done(0),
+	   stopping(false)
+	{
+		setp(buf, buf + sizeof buf);
+		writer = std::thread(&async_streambuf::writer_loop, this);
+	}
+
+	async_streambuf::~async_streambuf() { close(); }
+
+	void async_streambuf::close()
+	{
+		if (!writer.joinable()) return;
+		drain();
+		{
+			std::lock_guard<std::mutex> lk(m);
+			stopping = true;
+		}
+		writer_wakeup.notify_one();
+		producer_wakeup.notify_all();
+		writer.join();
+	}
+
+	void async_streambuf::publish(const char *s, std::size_t n)
+	{
+		std::unique_lock<std::mutex> lk(m);
+		while (n > 0)
+		{
+			if (stopping)
+			{
+				dropped += n;
+				break;
+			}
+			if (!spill.empty())
+			{
+				spill.push_back(std::string(s, n));
+				break;
+			}
+			std::size_t space = ring.size() - (head - tail);
+			if (space == 0)
+			{
+				if (policy == async_block)
+				{
+					writer_wakeup.notify_one();
+					producer_wakeup.wait(lk);
+					continue;
+				}
+				if (policy == async_spill) spill.push_back(std::string(s, n));
+				else dropped += n;
+				break;
+			}
+			/* Copy as much as fits, in at most two pieces around the wrap. */
+			std::size_t len = std::min(n, space);
+			std::size_t off = head % ring.size();
+			std::size_t first = std::min(len, ring.size() - off);
+			memcpy(&ring[off], s, first);
+			memcpy(&ring[0], s + first, len - first);
+			head += len;
+			s += len;
+			n -= len;
+		}
+		lk.unlock();
+		writer_wakeup.notify_one();
+	}
+
+	void async_streambuf::publish_put_area()
+	{
+		if (pptr() != pbase()) publish(pbase(), pptr() - pbase());
+		setp(buf, buf + sizeof buf);
+	}
+
+	void async_streambuf::writer_loop()
+	{
+		std::unique_lock<std::mutex> lk(m);
+		for (;;)
+		{
+			if (head != tail)
+			{
+				/* Write out the longest contiguous piece of the ring. The
+				 * producer won't touch it until we advance 'tail'. */
+				std::size_t off = tail % ring.size();
+				std::size_t len = std::min<unsigned long long>(head - tail, ring.size() - off);
+				lk.unlock();
+				target->sputn(&ring[off], len);
+				lk.lock();
+				tail += len;
+				producer_wakeup.notify_all();
+			}
+			else if (!spill.empty())
+			{
+				std::string s;
+				s.swap(spill.front());
+				spill.pop_front();
+				lk.unlock();
+				target->sputn(s.data(), s.size());
+				lk.lock();
+			}
+			else if (syncs_done != syncs_requested)
+			{
+				unsigned long long upto = syncs_requested;
+				lk.unlock();
+				target->pubsync();
+				lk.lock();
+				syncs_done = upto;
+				producer_wakeup.notify_all();
+			}
+			else if (stopping) break;
+			else writer_wakeup.wait(lk);
+		}
+	}
+
+	void async_streambuf::drain()
+	{
+		publish_put_area();
+		std::unique_lock<std::mutex> lk(m);
+		if (stopping) return;
+		unsigned long long ticket = ++syncs_requested;
+		writer_wakeup.notify_one();
+		while (syncs_done < ticket) producer_wakeup.wait(lk);
+	}
+
+	unsigned long long async_streambuf::dropped_bytes()
+	{
+		std::lock_guard<std::mutex> lk(m);
+		return dropped;
+	}
+
+	async_streambuf::int_type async_streambuf::overflow(int_type c)
+	{
+		publish_put_area();
+		if (!traits_type::eq_int_type(c, traits_type::eof()))
+		{
+			*pptr() = traits_type::to_char_type(c);
+			pbump(1);
+		}
+		return traits_type::not_eof(c);
+	}
+
+	std::streamsize async_streambuf::xsputn(const char *s, std::streamsize n)
+	{
+		/* Small writes go into the put area; big ones go straight to the
+		 * ring, once anything ahead of them has. */
+		if (n <= epptr() - pptr())
+		{
+			memcpy(pptr(), s, n);
+			pbump(n);
+			return n;
+		}
+		publish_put_area();
+		publish(s, n);
+		return n;
+	}
+
+	int async_streambuf::sync()
+	{
+		publish_put_area();
+		{
+			std::lock_guard<std::mutex> lk(m);
+			++syncs_requested;
+		}
+		writer_wakeup.notify_one();
+		return 0;
+	}
+}
@@ -0,0 +1,60 @@
+#include <srk31/compressing_streambuf.hpp>
+#include <boost/iostreams/filtering_streambuf.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/filter/zlib.hpp>
+#include <boost/iostreams/filter/bzip2.hpp>
+#include <boost/iostreams/filter/lzma.hpp>
+#include <boost/iostreams/filter/zstd.hpp>
+
+namespace srk31
+{
+	compressing_chain_member::compressing_chain_member(std::streambuf *out,
+		compression c, int level)
+	{
+		namespace io = boost::iostreams;
+		io::filtering_ostreambuf *p = new io::filtering_ostreambuf;
+		p_chain.reset(p);
+		switch (c)
+		{
+			case gzip_compression:
+				p->push(io::gzip_compressor(level == -1 ? io::gzip::default_compression : level));
+				break;
+			case zlib_compression:
+				p->push(io::zlib_compressor(level == -1 ? io::zlib::default_compression : level));
+				break;
+			case bzip2_compression:
+				p->push(io::bzip2_compressor(level == -1 ? io::bzip2::default_block_size : level));
+				break;
+			case lzma_compression:
+				p->push(io::lzma_compressor(level == -1 ? io::lzma::default_compression : level));
+				break;
+			case zstd_compression:
+				p->push(io::zstd_compressor(level == -1 ? io::zstd::default_compression : level));
+				break;
+		}
+		p->push(*out);
+	}
+
+	compressing_streambuf::compressing_streambuf(std::streambuf *out,
+		compression c, int level, std::size_t capacity, async_full_policy policy)
+	 : compressing_chain_member(out, c, level),
+	   async_streambuf(p_chain.get(), capacity, policy)
+	{}
+	compressing_streambuf::compressing_streambuf(std::ostream& out,
+		compression c, int level, std::size_t capacity, async_full_policy policy)
+	 : compressing_chain_member(out.rdbuf(), c, level),
+	   async_streambuf(p_chain.get(), capacity, policy)
+	{}
+
+	/* The chain would end the data when destroyed anyway, but our
+	 * async_streambuf part must stop writing to it first. */
+	compressing_streambuf::~compressing_streambuf() { finish(); }
+
+	void compressing_streambuf::finish()
+	{
+		close();
+		boost::iostreams::filtering_ostreambuf *p
+		 = static_cast<boost::iostreams::filtering_ostreambuf *>(p_chain.get());
+		if (!p->empty()) p->reset(); // closes the compressor, then the output
+	}
+}
@@ -1,63 +1,559 @@
+// the library itself doesn't use the old names, so mustn't make the streams
+#define SRK31_NO_INDENTING_STREAM_NAMES
 #include <srk31/indenting_ostream.hpp>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <tuple>
 
 namespace srk31
 {
-	struct newline_tabbing_filter : boost::iostreams::output_filter 
+	/* Indentation always comes out of this one run of tabs, so that
+	 * a whole level's worth goes downstream as a single block. Levels
+	 * deeper than the run just take several blocks. */
+	static const char tabs[] =
+		"\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t"
+		"\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t";
+	static const int tabs_len = sizeof tabs - 1;
+
+	/* We see the output a block at a time, not a character at a time.
+	 * We memchr() for each newline and hand 'put' the run up to and
+	 * including it, then call 'end_line', then hand 'put' the indentation.
+	 * Stops early if 'put' says so. */
+	template <typename Put, typename EndLine>
+	static bool write_indented(const char *s, std::streamsize n, int level,
+		Put put, EndLine end_line)
 	{
-		int *indent_level;
-		newline_tabbing_filter(int *plevel) : indent_level(plevel) {}
-		template<typename Sink>
-		bool put_char(Sink& dest, int c)
+		const char *end = s + n;
+		while (s != end)
 		{
-			if (!boost::iostreams::put(dest, c)) return false;
-			if (c == '\n')
+			const char *nl = static_cast<const char *>(memchr(s, '\n', end - s));
+			if (!put(s, (nl ? nl + 1 : end) - s)) return false;
+			if (!nl) break;
+			s = nl + 1;
+			end_line();
+			for (int i = level; i > 0; i -= tabs_len)
 			{
-				for (int i = *indent_level; i > 0; i--) 
+				if (!put(tabs, std::min(i, tabs_len))) return false;
+			}
+		}
+		return true;
+	}
+
+	indenting_streambuf::indenting_streambuf(std::ostream& target)
+	 : target(&target), sink(0), indent_level(0)
+	{ setp(buf, buf + sizeof buf); }
+	indenting_streambuf::indenting_streambuf(std::streambuf *sink)
+	 : target(0), sink(sink), indent_level(0)
+	{ setp(buf, buf + sizeof buf); }
+	const int indenting_streambuf::fd_batch_iovs;
+	indenting_streambuf::indenting_streambuf(int fd)
+	 : target(0), sink(0), indent_level(0), p_fd(new fd_batch)
+	{
+		p_fd->fd = fd;
+		p_fd->niov = 0;
+		setp(p_fd->buf, p_fd->buf + sizeof p_fd->buf);
+	}
+	indenting_streambuf::indenting_streambuf(indenting_streambuf&& o)
+	 : std::streambuf(o), target(o.target), sink(o.sink), indent_level(o.indent_level),
+	   p_fd(std::move(o.p_fd))
+	{
+		/* A batch lives on the heap, so our copied put area and its iovecs
+		 * are still good. Otherwise, take over the bytes in o's buffer. */
+		if (!p_fd)
+		{
+			std::ptrdiff_t pending = o.pptr() - o.pbase();
+			memcpy(buf, o.pbase(), pending);
+			setp(buf, buf + sizeof buf);
+			pbump(pending);
+		}
+		o.setp(o.buf, o.buf + sizeof o.buf);
+		o.target = 0;
+		o.sink = 0;
+	}
+
+	void indenting_streambuf::set_sink(std::ostream& target)
+	{ assert(!p_fd); drain_put_area(); this->target = &target; this->sink = 0; }
+	void indenting_streambuf::set_sink(std::streambuf *sink)
+	{ assert(!p_fd); drain_put_area(); this->target = 0; this->sink = sink; }
+
+	bool indenting_streambuf::put_indented(const char *s, std::streamsize n)
+	{
+		if (!p_fd)
+		{
+			std::streambuf *out = get_sink();
+			if (!out) return n == 0; // moved from
+			return write_indented(s, n, indent_level,
+				[out](const char *run, std::streamsize len) { return out->sputn(run, len) == len; },
+				[]() {});
+		}
+		fd_batch& b = *p_fd;
+		return write_indented(s, n, indent_level,
+			[this, &b](const char *run, std::streamsize len) {
+				if (b.niov > 0 && static_cast<const char *>(b.iov[b.niov - 1].iov_base)
+						+ b.iov[b.niov - 1].iov_len == run)
 				{
-					if (!boost::iostreams::put(dest, '\t')) return false;
+					b.iov[b.niov - 1].iov_len += len;
+					return true;
 				}
+				if (b.niov == fd_batch_iovs && !write_iovs()) return false;
+				b.iov[b.niov].iov_base = const_cast<char *>(run);
+				b.iov[b.niov].iov_len = len;
+				++b.niov;
+				return true;
+			},
+			[]() {});
+	}
+
+	/* Get the batched iovecs out, coping with short writes. The put area
+	 * is left alone: the caller may be part-way through turning it into
+	 * more iovecs. */
+	bool indenting_streambuf::write_iovs()
+	{
+		struct iovec *iov = p_fd->iov;
+		int n = p_fd->niov;
+		p_fd->niov = 0;
+		while (n > 0)
+		{
+			ssize_t ret = writev(p_fd->fd, iov, std::min(n, fd_batch_iovs));
+			if (ret < 0)
+			{
+				if (errno == EINTR) continue;
+				return false;
+			}
+			while (n > 0 && static_cast<std::size_t>(ret) >= iov->iov_len)
+			{
+				ret -= iov->iov_len;
+				++iov;
+				--n;
+			}
+			if (n > 0)
+			{
+				iov->iov_base = static_cast<char *>(iov->iov_base) + ret;
+				iov->iov_len -= ret;
+			}
+		}
+		return true;
+	}
+
+	bool indenting_streambuf::write_batch()
+	{
+		bool ok = write_iovs();
+		setp(p_fd->buf, p_fd->buf + sizeof p_fd->buf);
+		return ok;
+	}
+
+	bool indenting_streambuf::drain_put_area()
+	{
+		char *end = pptr();
+		bool ok = put_indented(pbase(), end - pbase());
+		if (!p_fd) setp(buf, buf + sizeof buf);
+		/* With a batch, carry on filling the put area after what we've just
+		 * turned into iovecs, until it's nearly full. Only then write. */
+		else if (epptr() - end < static_cast<std::ptrdiff_t>(sizeof buf)) ok = write_batch() && ok;
+		else setp(end, epptr());
+		return ok;
+	}
+
+	indenting_streambuf::int_type indenting_streambuf::overflow(int_type c)
+	{
+		if (!drain_put_area()) return traits_type::eof();
+		if (!traits_type::eq_int_type(c, traits_type::eof()))
+		{
+			*pptr() = traits_type::to_char_type(c);
+			pbump(1);
+		}
+		return traits_type::not_eof(c);
+	}
+
+	std::streamsize indenting_streambuf::xsputn(const char *s, std::streamsize n)
+	{
+		/* Small writes go into the put area; big ones go straight through. */
+		if (n <= epptr() - pptr())
+		{
+			memcpy(pptr(), s, n);
+			pbump(n);
+			return n;
+		}
+		if (!drain_put_area() || !put_indented(s, n)) return 0;
+		/* Our iovecs may point at the caller's bytes, so they go now. */
+		if (p_fd && !write_batch()) return 0;
+		return n;
+	}
+
+	int indenting_streambuf::sync()
+	{
+		if (!drain_put_area()) return -1;
+		if (p_fd) return write_batch() ? 0 : -1;
+		return get_sink() ? get_sink()->pubsync() : 0;
+	}
+
+	/* Every live per_thread_indenting_streambuf, by id, so that an exiting
+	 * thread can find those it has state in. Ids are never reused, so that
+	 * a later streambuf at the same address isn't mistaken for an old one.
+	 * Never destroyed, since threads may exit after static destructors. */
+	struct per_thread_registry
+	{
+		std::mutex lock;
+		unsigned long next_id;
+		std::map<unsigned long, per_thread_indenting_streambuf *> live;
+		per_thread_registry() : next_id(1) {}
+	};
+	static per_thread_registry& registry()
+	{
+		static per_thread_registry *r = new per_thread_registry;
+		return *r;
+	}
+
+	/* The ids of the streambufs this thread has state in, to forget it from
+	 * when the thread exits. */
+	struct per_thread_exit
+	{
+		std::vector<unsigned long> ids;
+		~per_thread_exit()
+		{
+			for (unsigned long id : ids)
+			{
+				per_thread_indenting_streambuf::forget_thread(id, std::this_thread::get_id());
 			}
-			return true;
 		}
-		template<typename Sink>
-    	bool put(Sink& dest, int c) 
-    	{
-        	return put_char(dest, c);
-    	}
 	};
-	
-	indenting_tty_ostream::indenting_tty_ostream(std::ostream& s) : 
-		std::ostream(p_wrapped_streambuf = new boost::iostreams::filtering_ostreambuf),
-		indent_level(0),
-		p_stream_filter(new newline_tabbing_filter(&indent_level))
+	static thread_local per_thread_exit this_thread_exit;
+
+	per_thread_indenting_streambuf::per_thread_indenting_streambuf(std::streambuf *sink, int base_level)
+	 : sink(sink), base_level(base_level)
+	{
+		per_thread_registry& r = registry();
+		std::lock_guard<std::mutex> lk(r.lock);
+		id = r.next_id++;
+		r.live[id] = this;
+	}
+	per_thread_indenting_streambuf::~per_thread_indenting_streambuf()
+	{
+		sync();
+		/* After this, no exiting thread can find us; 'states' goes with us. */
+		per_thread_registry& r = registry();
+		std::lock_guard<std::mutex> lk(r.lock);
+		r.live.erase(id);
+	}
+
+	void per_thread_indenting_streambuf::forget_thread(unsigned long id, std::thread::id t)
+	{
+		per_thread_registry& r = registry();
+		std::lock_guard<std::mutex> lk(r.lock);
+		auto i = r.live.find(id);
+		if (i == r.live.end()) return;
+		std::lock_guard<std::mutex> slk(i->second->states_lock);
+		i->second->states.erase(t);
+	}
+
+	/* We keep a one-entry cache in front of the table, since one thread
+	 * almost always talks to one stream. It's keyed by our id, so it's
+	 * never taken for a later streambuf's. */
+	per_thread_indenting_streambuf::thread_state&
+	per_thread_indenting_streambuf::state()
+	{
+		static thread_local unsigned long cached_id;
+		static thread_local thread_state *cached;
+		if (cached_id == id) return *cached;
+		std::thread::id t = std::this_thread::get_id();
+		bool added;
+		{
+			std::lock_guard<std::mutex> lk(states_lock);
+			auto i = states.find(t);
+			added = (i == states.end());
+			if (added)
+			{
+				i = states.emplace(std::piecewise_construct, std::forward_as_tuple(t),
+					std::forward_as_tuple(base_level, this)).first;
+			}
+			cached = &i->second;
+			cached_id = id;
+		}
+		if (added)
+		{
+			/* Note us for when this thread exits, and stop noting any
+			 * streambufs that have gone since. */
+			std::vector<unsigned long>& ids = this_thread_exit.ids;
+			per_thread_registry& r = registry();
+			std::lock_guard<std::mutex> lk(r.lock);
+			ids.erase(std::remove_if(ids.begin(), ids.end(),
+				[&r](unsigned long i) { return r.live.find(i) == r.live.end(); }), ids.end());
+			ids.push_back(id);
+		}
+		return *cached;
+	}
+
+	void per_thread_indenting_streambuf::set_sink(std::streambuf *s)
+	{
+		std::lock_guard<std::mutex> lk(sink_lock);
+		sink = s;
+	}
+
+	void per_thread_indenting_streambuf::publish(thread_state& st)
+	{
+		if (st.line.empty()) return;
+		{
+			std::lock_guard<std::mutex> lk(sink_lock);
+			sink->sputn(st.line.data(), st.line.size());
+		}
+		st.line.clear();
+	}
+
+	std::streamsize per_thread_indenting_streambuf::xsputn(const char *s, std::streamsize n)
+	{
+		thread_state& st = state();
+		const char *end = s + n;
+		while (s != end)
+		{
+			for (; st.pending_indent > 0; st.pending_indent -= tabs_len)
+			{
+				st.line.append(tabs, std::min(st.pending_indent, tabs_len));
+			}
+			st.pending_indent = 0;
+			const char *nl = static_cast<const char *>(memchr(s, '\n', end - s));
+			st.line.append(s, (nl ? nl + 1 : end) - s);
+			if (!nl) break;
+			s = nl + 1;
+			publish(st);
+			st.pending_indent = st.level;
+		}
+		return n;
+	}
+
+	per_thread_indenting_streambuf::int_type
+	per_thread_indenting_streambuf::overflow(int_type c)
+	{
+		if (!traits_type::eq_int_type(c, traits_type::eof()))
+		{
+			char ch = traits_type::to_char_type(c);
+			xsputn(&ch, 1);
+		}
+		return traits_type::not_eof(c);
+	}
+
+	int per_thread_indenting_streambuf::sync()
+	{
+		publish(state());
+		std::lock_guard<std::mutex> lk(sink_lock);
+		return sink->pubsync();
+	}
+
+	capture_streambuf::capture_streambuf(int base_level)
+	 : cur_chunk(0), base_level(base_level), cur_level(base_level)
+	{
+		chunks.push_back(std::unique_ptr<char[]>(new char[chunk_size]));
+		setp(chunks[0].get(), chunks[0].get() + chunk_size);
+	}
+
+	/* Record what's in the put area, and carry on after it. */
+	void capture_streambuf::seal()
+	{
+		if (pptr() == pbase()) return;
+		/* Writes that merely continue the last one extend it. */
+		if (!events.empty() && events.back().text
+			&& events.back().text + events.back().len == pbase())
+		{ events.back().len += pptr() - pbase(); }
+		else
+		{
+			event e = { pbase(), static_cast<std::size_t>(pptr() - pbase()), 0 };
+			events.push_back(e);
+		}
+		setp(pptr(), epptr());
+	}
+
+	capture_streambuf::mark capture_streambuf::here()
+	{
+		seal();
+		mark m = { events.size(), cur_chunk, pptr(), cur_level };
+		return m;
+	}
+
+	void capture_streambuf::rewind(const mark& m)
+	{
+		events.resize(m.nevents);
+		cur_chunk = m.chunk;
+		setp(m.pos, chunks[cur_chunk].get() + chunk_size);
+		cur_level = m.level;
+	}
+
+	void capture_streambuf::change_level(int delta, const char *marker)
+	{
+		seal();
+		event e = { 0, 0, delta };
+		events.push_back(e);
+		cur_level += delta;
+		sputn(marker, strlen(marker));
+		for (; delta > 0; --delta) open_levels.push_back(here());
+		for (; delta < 0 && !open_levels.empty(); ++delta) open_levels.pop_back();
+	}
+
+	void capture_streambuf::discard_subtree()
 	{
-		p_wrapped_streambuf->push(*p_stream_filter);
-		p_wrapped_streambuf->push(s);
+		if (!open_levels.empty()) rewind(open_levels.back());
+		else
+		{
+			mark start = { 0, 0, chunks[0].get(), base_level };
+			rewind(start);
+		}
+	}
+
+	void capture_streambuf::replay(indenting_streambuf& out)
+	{
+		seal();
+		out.set_level(base_level);
+		for (std::vector<event>::iterator i = events.begin(); i != events.end(); ++i)
+		{
+			if (i->text) out.sputn(i->text, i->len);
+			else out.set_level(out.level() + i->delta);
+		}
+	}
+
+	capture_streambuf::int_type capture_streambuf::overflow(int_type c)
+	{
+		seal();
+		if (++cur_chunk == chunks.size())
+		{
+			chunks.push_back(std::unique_ptr<char[]>(new char[chunk_size]));
+		}
+		setp(chunks[cur_chunk].get(), chunks[cur_chunk].get() + chunk_size);
+		if (!traits_type::eq_int_type(c, traits_type::eof()))
+		{
+			*pptr() = traits_type::to_char_type(c);
+			pbump(1);
+		}
+		return traits_type::not_eof(c);
+	}
+
+	int capture_streambuf::sync() { seal(); return 0; }
+
+	indenting_ostream_base::indenting_ostream_base(std::ostream& s)
+	 : std::ostream(0), m_buf(s), p_target(&s), p_sink(0), p_async(0), p_concurrent(0), p_capture(0)
+	{ rdbuf(&m_buf); }
+	indenting_ostream_base::indenting_ostream_base(std::streambuf *sink)
+	 : std::ostream(0), m_buf(sink), p_target(0), p_sink(sink), p_async(0), p_concurrent(0), p_capture(0)
+	{ rdbuf(&m_buf); }
+	indenting_ostream_base::indenting_ostream_base(int fd)
+	 : std::ostream(0), m_buf(fd), p_target(0), p_sink(0), p_async(0), p_concurrent(0), p_capture(0)
+	{ rdbuf(&m_buf); }
+	indenting_ostream_base::indenting_ostream_base(indenting_ostream_base&& o)
+	 : std::ostream(std::move(o)), m_buf(std::move(o.m_buf)),
+	   p_target(o.p_target), p_sink(o.p_sink), p_async(o.p_async), p_concurrent(o.p_concurrent),
+	   p_capture(o.p_capture)
+	{
+		/* std::ostream's move leaves both rdbufs as they were; fix them up. */
+		set_rdbuf(active_buf());
+		/* An fd stream's threads write through m_buf, which has moved. */
+		if (p_concurrent) p_concurrent->set_sink(m_buf.writes_to_fd() ? &m_buf : m_buf.get_sink());
+		o.set_rdbuf(&o.m_buf);
+		o.p_async = 0;
+		o.p_concurrent = 0;
+		o.p_capture = 0;
+	}
+	indenting_ostream_base::~indenting_ostream_base()
+	{
+		end_capture(false);
+		set_concurrent(false);
+		set_sync();
+		m_buf.pubsync();
 	}
-	indenting_tty_ostream::~indenting_tty_ostream() { delete p_stream_filter; delete p_wrapped_streambuf; }
-	indenting_tty_ostream indenting_tty_cout(std::cout), indenting_tty_cerr(std::cerr);
 
-	indenting_newline_ostream::indenting_newline_ostream(std::ostream& s) : 
-		std::ostream(p_wrapped_streambuf = new boost::iostreams::filtering_ostreambuf),
-		indent_level(0),
-		p_stream_filter(new newline_tabbing_filter(&indent_level))
+	void indenting_ostream_base::set_async(async_full_policy policy, std::size_t capacity)
+	{
+		if (p_async || m_buf.writes_to_fd()) return;
+		flush();
+		p_async = new async_streambuf(direct_sink(), capacity, policy);
+		m_buf.set_sink(p_async);
+		if (p_concurrent) p_concurrent->set_sink(p_async);
+	}
+	void indenting_ostream_base::set_sync()
+	{
+		if (!p_async) return;
+		flush();
+		if (p_target) m_buf.set_sink(*p_target);
+		else m_buf.set_sink(p_sink);
+		if (p_concurrent) p_concurrent->set_sink(direct_sink());
+		delete p_async; // drains
+		p_async = 0;
+	}
+	void indenting_ostream_base::drain()
 	{
-		p_wrapped_streambuf->push(*p_stream_filter);
-		p_wrapped_streambuf->push(s);
+		flush();
+		if (p_async) p_async->drain();
+	}
+	void indenting_ostream_base::set_concurrent(bool concurrent)
+	{
+		if (concurrent == (p_concurrent != 0) || p_capture) return;
+		flush();
+		if (concurrent)
+		{
+			/* Threads start at our level, and do all the indenting. Lines
+			 * from an fd stream's threads go through our own buffer to be
+			 * batched, so it mustn't add its own indentation meanwhile. */
+			p_concurrent = new per_thread_indenting_streambuf(
+				m_buf.writes_to_fd() ? &m_buf : m_buf.get_sink(), m_buf.level());
+			m_buf.set_level(0);
+			rdbuf(p_concurrent);
+		}
+		else
+		{
+			rdbuf(&m_buf);
+			m_buf.set_level(p_concurrent->get_base_level());
+			delete p_concurrent;
+			p_concurrent = 0;
+		}
 	}
-	indenting_newline_ostream::~indenting_newline_ostream() { delete p_stream_filter; delete p_wrapped_streambuf; }
-	indenting_newline_ostream indenting_newline_cout(std::cout), indenting_newline_cerr(std::cerr);
 
-	indenting_ostream::indenting_ostream(std::ostream& s) : 
-		std::ostream(p_wrapped_streambuf = new boost::iostreams::filtering_ostreambuf),
-		indent_level(0),
-		p_stream_filter(new newline_tabbing_filter(&indent_level))
+	void indenting_ostream_base::begin_capture()
+	{
+		if (p_capture || p_concurrent) return;
+		flush();
+		p_capture = new capture_streambuf(m_buf.level());
+		rdbuf(p_capture);
+	}
+	void indenting_ostream_base::discard_subtree()
+	{
+		if (!p_capture) return;
+		p_capture->discard_subtree();
+	}
+	void indenting_ostream_base::render_capture(std::ostream& out)
 	{
-		p_wrapped_streambuf->push(*p_stream_filter);
-		p_wrapped_streambuf->push(s);
+		if (!p_capture) return;
+		indenting_streambuf formatter(out);
+		p_capture->replay(formatter);
+		formatter.pubsync();
+	}
+	void indenting_ostream_base::end_capture(bool render)
+	{
+		if (!p_capture) return;
+		if (render)
+		{
+			p_capture->replay(m_buf);
+			m_buf.pubsync();
+		}
+		else m_buf.set_level(p_capture->level());
+		rdbuf(&m_buf);
+		delete p_capture;
+		p_capture = 0;
 	}
-	indenting_ostream::~indenting_ostream() { delete p_stream_filter; delete p_wrapped_streambuf; }
-	indenting_ostream indenting_cout(std::cout), indenting_cerr(std::cerr);
 
+	template class basic_indenting_ostream<tty_indent_policy>;
+	template class basic_indenting_ostream<newline_indent_policy>;
+	template class basic_indenting_ostream<guess_indent_policy>;
 
+	/* Function-local statics: made on first call, thread-safely. Any
+	 * caller has <iostream>'s initializer ahead of it, so std::cout and
+	 * std::cerr are made before these, and outlive them. */
+	indenting_tty_ostream& get_indenting_tty_cout()
+	{ static indenting_tty_ostream s(std::cout); return s; }
+	indenting_tty_ostream& get_indenting_tty_cerr()
+	{ static indenting_tty_ostream s(std::cerr); return s; }
+	indenting_newline_ostream& get_indenting_newline_cout()
+	{ static indenting_newline_ostream s(std::cout); return s; }
+	indenting_newline_ostream& get_indenting_newline_cerr()
+	{ static indenting_newline_ostream s(std::cerr); return s; }
+	indenting_ostream& get_indenting_cout()
+	{ static indenting_ostream s(std::cout); return s; }
+	indenting_ostream& get_indenting_cerr()
+	{ static indenting_ostream s(std::cerr); return s; }
 }
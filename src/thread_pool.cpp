@@ -0,0 +1,95 @@
+#include <srk31/thread_pool.hpp>
+#include <algorithm>
+
+namespace srk31
+{
+	/* Set while this thread is running some pool's f, so that a nested
+	 * run() knows not to wait for workers. */
+	static thread_local bool in_pool;
+
+	thread_pool::thread_pool(unsigned nworkers)
+	 : job(0), njobs(0), next(0), generation(0), busy(0), stopping(false)
+	{
+		for (unsigned i = 0; i < nworkers; ++i)
+		{
+			workers.push_back(std::thread(&thread_pool::worker_loop, this));
+		}
+	}
+
+	thread_pool::~thread_pool()
+	{
+		{
+			std::lock_guard<std::mutex> lk(m);
+			stopping = true;
+		}
+		work_ready.notify_all();
+		for (auto& w : workers) w.join();
+	}
+
+	thread_pool& thread_pool::instance()
+	{
+		static thread_pool *p = new thread_pool(
+			std::max(std::thread::hardware_concurrency(), 1u) - 1);
+		return *p;
+	}
+
+	void thread_pool::work()
+	{
+		bool was_in_pool = in_pool;
+		in_pool = true;
+		for (std::size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < njobs; )
+		{
+			try { (*job)(i); }
+			catch (...)
+			{
+				std::lock_guard<std::mutex> lk(m);
+				if (!failure) failure = std::current_exception();
+				next.store(njobs, std::memory_order_relaxed);
+			}
+		}
+		in_pool = was_in_pool;
+	}
+
+	void thread_pool::worker_loop()
+	{
+		unsigned long long done = 0;
+		std::unique_lock<std::mutex> lk(m);
+		for (;;)
+		{
+			while (!stopping && generation == done) work_ready.wait(lk);
+			if (stopping) return;
+			done = generation;
+			lk.unlock();
+			work();
+			lk.lock();
+			if (--busy == 0) work_done.notify_one();
+		}
+	}
+
+	void thread_pool::run(std::size_t n, const std::function<void(std::size_t)>& f)
+	{
+		if (workers.empty() || in_pool || n < 2)
+		{
+			for (std::size_t i = 0; i < n; ++i) f(i);
+			return;
+		}
+		std::lock_guard<std::mutex> serialise(run_lock);
+		{
+			std::lock_guard<std::mutex> lk(m);
+			job = &f;
+			njobs = n;
+			next.store(0, std::memory_order_relaxed);
+			busy = workers.size();
+			++generation;
+		}
+		work_ready.notify_all();
+		work();
+		std::unique_lock<std::mutex> lk(m);
+		while (busy != 0) work_done.wait(lk);
+		job = 0;
+		std::exception_ptr e = failure;
+		failure = nullptr;
+		lk.unlock();
+		if (e) std::rethrow_exception(e);
+	}
+}
@@ -0,0 +1,148 @@
+/* Per-element cost of walking a concatenating_sequence, against a nested
+ * loop over the same segments.
+ *
+ * Build with something like
+ *   c++ -std=c++11 -O2 -I../include concatenating_iterator_bench.cpp
+ *
+ * Run with the segment length as an argument to see how the cost of
+ * crossing from one segment to the next shows up as segments get short.
+ * Also srk31::accumulate(), which sums each segment with a loop of its own.
+ *
+ * Then binary search: std::lower_bound over the whole sequence, which
+ * jumps around by index rather than walking.
+ *
+ * Last, the cost of a short-lived concatenation of three small ranges,
+ * built, walked and thrown away each time, as a concatenating_sequence
+ * and as a concatenating_view.
+ *
+ * And a concatenate() of a vector, an array and a deque, walked with its
+ * iterator and with srk31::for_each, against loops over each. */
+
+#include <srk31/concatenating_iterator.hpp>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+using namespace srk31;
+
+typedef std::vector<int>::iterator iter;
+typedef concatenating_sequence<iter> sequence;
+
+template <typename F>
+static double ns_per_element(F f, std::size_t nelems, unsigned reps)
+{
+	long sum = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned r = 0; r < reps; ++r) sum += f();
+	double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+	if (sum == 42) printf("(unlikely)\n"); // keep the loops alive
+	return ns / reps / nelems;
+}
+
+int main(int argc, char **argv)
+{
+	std::size_t seglen = (argc > 1) ? atoi(argv[1]) : 1000;
+	std::size_t nelems = 1 << 22;
+	std::size_t nsegs = (nelems + seglen - 1) / seglen;
+	std::vector< std::vector<int> > segs(nsegs, std::vector<int>(seglen));
+	for (std::size_t i = 0; i < nsegs; ++i)
+		for (std::size_t j = 0; j < seglen; ++j) segs[i][j] = (int) (i ^ j);
+	std::vector<int> flat;
+	for (auto& s : segs) flat.insert(flat.end(), s.begin(), s.end());
+	auto p_seq = std::make_shared<sequence>();
+	for (auto& s : segs) p_seq->append(s.begin(), s.end());
+	nelems = nsegs * seglen;
+
+	double nested = ns_per_element([&]() {
+		long sum = 0;
+		for (auto& s : segs) for (int x : s) sum += x;
+		return sum;
+	}, nelems, 20);
+	double concat = ns_per_element([&]() {
+		long sum = 0;
+		auto end = p_seq->end();
+		for (auto i = p_seq->begin(); i != end; ++i) sum += *i;
+		return sum;
+	}, nelems, 20);
+	double segmented = ns_per_element([&]() {
+		return srk31::accumulate(p_seq->begin(), p_seq->end(), 0L);
+	}, nelems, 20);
+	printf("segments of %zu: nested loop %.3f ns/element, concatenating_iterator %.3f ns/element (%.1fx), "
+		"segmented accumulate %.3f ns/element (%.1fx)\n",
+		seglen, nested, concat, concat / nested, segmented, segmented / nested);
+
+	std::sort(flat.begin(), flat.end());
+	std::copy(flat.begin(), flat.end(), p_seq->begin());
+	const unsigned nsearches = 1000000;
+	auto search = [&](const std::function<long(int)>& f) {
+		long sum = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (unsigned i = 0; i < nsearches; ++i) sum += f((int) ((i * 2654435761u) % nelems));
+		double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+		if (sum == 42) printf("(unlikely)\n");
+		return ns / nsearches;
+	};
+	double flat_ns = search([&](int v) {
+		return std::lower_bound(flat.begin(), flat.end(), v) - flat.begin();
+	});
+	double concat_ns = search([&](int v) {
+		return std::lower_bound(p_seq->begin(), p_seq->end(), v) - p_seq->begin();
+	});
+	printf("lower_bound: flat vector %.1f ns, concatenating_iterator %.1f ns\n", flat_ns, concat_ns);
+
+	const unsigned nviews = 1000000;
+	std::vector<int> r1(4, 1), r2(3, 2), r3(5, 3);
+	double seq_ns = ns_per_element([&]() {
+		long sum = 0;
+		for (unsigned i = 0; i < nviews; ++i)
+		{
+			auto p = std::make_shared<sequence>(r1.begin(), r1.end(), r2.begin(), r2.end());
+			p->append(r3.begin(), r3.end());
+			for (auto j = p->begin(), e = p->end(); j != e; ++j) sum += *j;
+		}
+		return sum;
+	}, nviews, 5);
+	double view_ns = ns_per_element([&]() {
+		long sum = 0;
+		for (unsigned i = 0; i < nviews; ++i)
+		{
+			concatenating_view<iter, 3> v(r1.begin(), r1.end(), r2.begin(), r2.end(), r3.begin(), r3.end());
+			for (int x : v) sum += x;
+		}
+		return sum;
+	}, nviews, 5);
+	printf("three short ranges: concatenating_sequence %.1f ns, concatenating_view %.1f ns\n", seq_ns, view_ns);
+
+	std::vector<int> hv(nelems / 3, 1);
+	static std::array<int, (1 << 22) / 3> ha;
+	ha.fill(2);
+	std::deque<int> hd(nelems / 3, 3);
+	auto hc = concatenate(hv, ha, hd);
+	std::size_t hn = hv.size() + ha.size() + hd.size();
+	double loops = ns_per_element([&]() {
+		long sum = 0;
+		for (int x : hv) sum += x;
+		for (int x : ha) sum += x;
+		for (int x : hd) sum += x;
+		return sum;
+	}, hn, 20);
+	double walked = ns_per_element([&]() {
+		long sum = 0;
+		for (int x : hc) sum += x;
+		return sum;
+	}, hn, 20);
+	double each = ns_per_element([&]() {
+		long sum = 0;
+		srk31::for_each(hc, [&sum](int x) { sum += x; });
+		return sum;
+	}, hn, 20);
+	printf("vector, array, deque: separate loops %.3f ns/element, concatenate() iterator %.3f ns/element, "
+		"for_each %.3f ns/element\n", loops, walked, each);
+	return 0;
+}
@@ -0,0 +1,142 @@
+/* Throughput of the indenting streams against a plain std::ostream.
+ * 
+ * Build with something like
+ *   c++ -O2 -pthread -I../include $(pkg-config --cflags libc++fileno) \
+ *     indenting_ostream_bench.cpp ../src/indenting_ostream.cpp ../src/async_streambuf.cpp \
+ *     ../src/compressing_streambuf.cpp -lboost_iostreams
+ *
+ * Everything goes to a streambuf that throws the bytes away, so what we
+ * measure is the cost of the stream layers, not the I/O. */
+
+#include <srk31/indenting_ostream.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace srk31;
+
+struct null_streambuf : std::streambuf
+{
+	unsigned long long count;
+	char buf[4096];
+	null_streambuf() : count(0) { setp(buf, buf + sizeof buf); }
+	int_type overflow(int_type c)
+	{
+		count += pptr() - pbase();
+		setp(buf, buf + sizeof buf);
+		if (c != traits_type::eof()) { count++; }
+		return traits_type::not_eof(c);
+	}
+	std::streamsize xsputn(const char *, std::streamsize n)
+	{ overflow(traits_type::eof()); count += n; return n; }
+	int sync() { overflow(traits_type::eof()); return 0; }
+};
+
+/* Something shaped like one of our tree dumps: short lines, some nesting. */
+template <typename Stream>
+static void dump(Stream& s, unsigned nlines, void (*inc)(Stream&), void (*dec)(Stream&))
+{
+	for (unsigned i = 0; i < nlines; ++i)
+	{
+		if (i % 16 == 0 && inc) inc(s);
+		s << "node " << i << " at 0x" << std::hex << (i * 4096) << std::dec
+			<< ", attributes: name = \"some_identifier\", size = " << (i % 97) << "\n";
+		if (i % 16 == 15 && dec) dec(s);
+	}
+	s.flush();
+}
+
+template <typename Stream>
+static void inc(Stream& s) { s.inc_level(); }
+template <typename Stream>
+static void dec(Stream& s) { s.dec_level(); }
+
+static void report(const char *name, unsigned long long bytes,
+	std::chrono::steady_clock::duration d)
+{
+	double secs = std::chrono::duration<double>(d).count();
+	std::cout << name << ": " << bytes << " bytes in " << secs << " s, "
+		<< (bytes / secs / (1024 * 1024)) << " MiB/s" << std::endl;
+}
+
+template <typename Stream>
+static void run(const char *name, unsigned nlines)
+{
+	null_streambuf sb;
+	std::ostream out(&sb);
+	Stream s(out);
+	auto start = std::chrono::steady_clock::now();
+	dump<Stream>(s, nlines, &inc<Stream>, &dec<Stream>);
+	report(name, sb.count, std::chrono::steady_clock::now() - start);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned nlines = (argc > 1) ? std::atoi(argv[1]) : 2000000;
+	{
+		null_streambuf sb;
+		std::ostream s(&sb);
+		auto start = std::chrono::steady_clock::now();
+		dump<std::ostream>(s, nlines, nullptr, nullptr);
+		report("std::ostream", sb.count, std::chrono::steady_clock::now() - start);
+	}
+	run<indenting_ostream>("indenting_ostream", nlines);
+	run<indenting_tty_ostream>("indenting_tty_ostream", nlines);
+	run<indenting_newline_ostream>("indenting_newline_ostream", nlines);
+
+	/* Now real output to /dev/null, so that we count the system calls'
+	 * worth of overhead too: through std::ofstream versus straight to
+	 * the fd with writev(). First write the same text once more, just
+	 * to count it. */
+	null_streambuf count_only;
+	{
+		std::ostream counted(&count_only);
+		indenting_newline_ostream s(counted);
+		dump<indenting_newline_ostream>(s, nlines, &inc<indenting_newline_ostream>,
+			&dec<indenting_newline_ostream>);
+	}
+	{
+		std::ofstream f("/dev/null");
+		indenting_newline_ostream s(f);
+		auto start = std::chrono::steady_clock::now();
+		dump<indenting_newline_ostream>(s, nlines, &inc<indenting_newline_ostream>,
+			&dec<indenting_newline_ostream>);
+		report("indenting_newline_ostream over std::ofstream",
+			count_only.count, std::chrono::steady_clock::now() - start);
+	}
+	{
+		int fd = open("/dev/null", O_WRONLY);
+		indenting_newline_ostream s(fd);
+		auto start = std::chrono::steady_clock::now();
+		dump<indenting_newline_ostream>(s, nlines, &inc<indenting_newline_ostream>,
+			&dec<indenting_newline_ostream>);
+		report("indenting_newline_ostream over fd (writev)",
+			count_only.count, std::chrono::steady_clock::now() - start);
+		close(fd);
+	}
+
+	/* Compressed output. The clock runs until the compressor has finished,
+	 * so this is end-to-end throughput, in uncompressed bytes. */
+	struct { compression c; const char *name; } compressors[] = {
+		{ gzip_compression, "gzip" },
+		{ zstd_compression, "zstd" }
+	};
+	for (auto& comp : compressors)
+	{
+		null_streambuf out;
+		auto start = std::chrono::steady_clock::now();
+		{
+			indenting_compressed_ostream<> s(&out, comp.c);
+			dump<indenting_compressed_ostream<> >(s, nlines,
+				&inc<indenting_compressed_ostream<> >, &dec<indenting_compressed_ostream<> >);
+		}
+		std::string name = std::string("indenting_newline_ostream, ") + comp.name
+			+ " (compressed to " + std::to_string(out.count) + " bytes)";
+		report(name.c_str(), count_only.count, std::chrono::steady_clock::now() - start);
+	}
+	return 0;
+}
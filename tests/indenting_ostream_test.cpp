@@ -0,0 +1,104 @@
+/* Checks on what the indenting streams write, as opposed to how fast.
+ *
+ * Build with something like
+ *   c++ -O2 -pthread -I../include $(pkg-config --cflags libc++fileno) \
+ *     indenting_ostream_test.cpp ../src/indenting_ostream.cpp ../src/async_streambuf.cpp \
+ *     ../src/compressing_streambuf.cpp -lboost_iostreams
+ *
+ * Exits non-zero, saying why, on the first thing that's wrong. */
+
+#include <srk31/indenting_ostream.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace srk31;
+
+static void check(bool ok, const char *what)
+{
+	if (ok) return;
+	std::fprintf(stderr, "FAILED: %s\n", what);
+	std::exit(1);
+}
+
+/* Several threads, each at its own level, ending lines with std::endl or
+ * "\n" then std::flush. Each line must come out whole, carrying its own
+ * thread's indentation and nobody else's. Blank lines (from inc_level()'s
+ * marker) may carry indentation but nothing else. */
+static void test_concurrent_flush()
+{
+	const unsigned nthreads = 4, nlines = 20000;
+	std::string out;
+	{
+		indenting_string_ostream<> s(out);
+		s.set_concurrent();
+		std::vector<std::thread> threads;
+		for (unsigned t = 0; t < nthreads; ++t)
+		{
+			threads.emplace_back([&s, t]() {
+				for (unsigned i = 0; i <= t; ++i) s.inc_level();
+				std::ostream& os = s.thread_stream();
+				for (unsigned i = 0; i < nlines; ++i)
+				{
+					if (i % 2) os << "thread " << t << " line " << i << std::endl;
+					else os << "thread " << t << " line " << i << "\n" << std::flush;
+				}
+			});
+		}
+		for (auto& th : threads) th.join();
+		s.set_concurrent(false);
+	}
+
+	std::istringstream in(out);
+	std::string line;
+	unsigned nseen = 0;
+	while (std::getline(in, line))
+	{
+		std::size_t ntabs = line.find_first_not_of('\t');
+		if (ntabs == std::string::npos) continue;
+		unsigned t;
+		check(std::sscanf(line.c_str() + ntabs, "thread %u line", &t) == 1,
+			"concurrent line is whole");
+		check(ntabs == 1 + t, "concurrent line has its own thread's indentation");
+		++nseen;
+	}
+	check(nseen == nthreads * nlines, "every concurrent line came out");
+}
+
+/* Capturing, with a subtree discarded and more written at the same level,
+ * must come out as if the subtree had never been written. */
+static void test_discard_then_write()
+{
+	std::string expected, captured;
+	{
+		indenting_string_ostream<> s(expected);
+		s << "a\n";
+		s.inc_level();
+		s << "kept\n";
+		s.dec_level();
+		s << "b\n";
+	}
+	{
+		indenting_string_ostream<> s(captured);
+		s.begin_capture();
+		s << "a\n";
+		s.inc_level();
+		s << "dropped\n";
+		s.discard_subtree();
+		s << "kept\n";
+		s.dec_level();
+		s << "b\n";
+		s.end_capture();
+	}
+	check(captured == expected, "discarded subtree leaves its level's marker alone");
+}
+
+int main()
+{
+	test_concurrent_flush();
+	test_discard_then_write();
+	return 0;
+}
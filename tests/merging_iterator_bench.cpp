@@ -0,0 +1,131 @@
+/* Merging k sorted runs: copying them out and std::sort()ing, against
+ * walking a merging_sequence, against its merge_into(), which goes a block
+ * at a time.
+ *
+ * Build with something like
+ *   c++ -std=c++11 -O2 -I../include merging_iterator_bench.cpp
+ *
+ * Run with k as an argument. "interleaved" runs take turns element by
+ * element, so blocks are short; "clustered" ones take turns in stretches
+ * of a few hundred, which is where blocks pay off.
+ *
+ * Before timing anything, we check the merge: walking, copy_block() and
+ * merge_into() must all give what std::stable_sort() of the runs laid end
+ * to end gives, so equal keys come out in run order. Exits non-zero if
+ * not. */
+
+#include <srk31/merging_iterator.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <utility>
+#include <vector>
+
+using namespace srk31;
+
+typedef std::vector<int>::const_iterator iter;
+
+template <typename F>
+static double ns_per_element(F f, std::size_t nelems, unsigned reps)
+{
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned r = 0; r < reps; ++r) f();
+	double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+	return ns / reps / nelems;
+}
+
+/* Each element tagged with its run, compared on the key alone. */
+typedef std::pair<int, std::size_t> tagged;
+struct key_less
+{ bool operator()(const tagged& a, const tagged& b) const { return a.first < b.first; } };
+
+static void check(bool ok, const char *what)
+{
+	if (ok) return;
+	fprintf(stderr, "FAILED: %s\n", what);
+	exit(1);
+}
+
+/* Keys are taken modulo 'mod', if it's non-zero, to make plenty of ties. */
+static void check_merge(const std::vector< std::vector<int> >& runs, int mod)
+{
+	std::vector< std::vector<tagged> > truns(runs.size());
+	std::vector<tagged> expected;
+	for (std::size_t i = 0; i < runs.size(); ++i)
+	{
+		for (int x : runs[i]) truns[i].push_back(tagged(mod ? x % mod : x, i));
+		std::sort(truns[i].begin(), truns[i].end(), key_less());
+		expected.insert(expected.end(), truns[i].begin(), truns[i].end());
+	}
+	std::stable_sort(expected.begin(), expected.end(), key_less());
+
+	typedef std::vector<tagged>::const_iterator titer;
+	merging_sequence<titer, key_less> seq;
+	for (auto& r : truns) seq.append(r.begin(), r.end());
+
+	std::vector<tagged> walked;
+	for (auto i = seq.begin(), e = seq.end(); i != e; ++i)
+	{
+		check(i.get_currently_in() == i->second, "merging_iterator knows which run it's in");
+		walked.push_back(*i);
+	}
+	check(walked == expected, "merging_iterator matches std::stable_sort");
+
+	std::vector<tagged> blocks;
+	for (auto i = seq.begin(); !i.at_end(); ) i.copy_block(std::back_inserter(blocks), 3);
+	check(blocks == expected, "copy_block matches std::stable_sort");
+
+	std::vector<tagged> merged(expected.size());
+	seq.merge_into(merged.begin());
+	check(merged == expected, "merge_into matches std::stable_sort");
+}
+
+static void run(const char *name, const std::vector< std::vector<int> >& runs, std::size_t nelems)
+{
+	std::vector<int> out(nelems);
+	merging_sequence<iter> seq;
+	for (auto& r : runs) seq.append(r.begin(), r.end());
+
+	double sorted = ns_per_element([&]() {
+		auto o = out.begin();
+		for (auto& r : runs) o = std::copy(r.begin(), r.end(), o);
+		std::sort(out.begin(), out.end());
+	}, nelems, 5);
+	double walked = ns_per_element([&]() {
+		auto o = out.begin();
+		for (auto i = seq.begin(), e = seq.end(); i != e; ++i) *o++ = *i;
+	}, nelems, 5);
+	double blocks = ns_per_element([&]() {
+		seq.merge_into(out.begin());
+	}, nelems, 5);
+	printf("%-12s k=%zu: copy and sort %.2f ns/element, merging_iterator %.2f ns/element, "
+		"merge_into %.2f ns/element\n", name, runs.size(), sorted, walked, blocks);
+}
+
+int main(int argc, char **argv)
+{
+	std::size_t k = (argc > 1) ? atoi(argv[1]) : 16;
+	std::size_t nelems = 1 << 22;
+	std::size_t len = nelems / k;
+	nelems = len * k;
+
+	std::vector< std::vector<int> > runs(k, std::vector<int>(len));
+	srand(1);
+	for (auto& r : runs)
+	{
+		for (auto& x : r) x = rand();
+		std::sort(r.begin(), r.end());
+	}
+	check_merge(runs, 0);
+	check_merge(runs, 16);
+	run("interleaved", runs, nelems);
+	// run i gets stretches [j * 256 * k + i * 256, ... + 256)
+	for (std::size_t i = 0; i < k; ++i)
+		for (std::size_t j = 0; j < len; ++j)
+			runs[i][j] = (int) ((j / 256) * 256 * k + i * 256 + j % 256);
+	check_merge(runs, 0);
+	check_merge(runs, 16);
+	run("clustered", runs, nelems);
+	return 0;
+}
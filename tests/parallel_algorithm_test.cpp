@@ -0,0 +1,87 @@
+/* Checks that the parallel algorithms over a concatenating_sequence give
+ * what a serial walk of begin() .. end() gives.
+ *
+ * Build with something like
+ *   c++ -std=c++14 -O2 -pthread -I../include parallel_algorithm_test.cpp ../src/thread_pool.cpp
+ *
+ * Exits non-zero, saying why, on the first thing that's wrong. */
+
+#include <srk31/parallel_algorithm.hpp>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace srk31;
+
+static void check(bool ok, const char *what)
+{
+	if (ok) return;
+	std::fprintf(stderr, "FAILED: %s\n", what);
+	std::exit(1);
+}
+
+/* Segments holding 0 .. n-1 between them, in order, some of them empty. */
+template <typename Container>
+static std::vector<Container> make_segments(const std::vector<std::size_t>& lengths)
+{
+	std::vector<Container> segs;
+	int next = 0;
+	for (std::size_t len : lengths)
+	{
+		Container c;
+		for (std::size_t i = 0; i < len; ++i) c.push_back(next++);
+		segs.push_back(c);
+	}
+	return segs;
+}
+
+template <typename Container>
+static void test_against_serial(const char *what, const std::vector<std::size_t>& lengths,
+	thread_pool& pool)
+{
+	typedef typename Container::iterator iter;
+	std::vector<Container> segs = make_segments<Container>(lengths);
+	auto seq = std::make_shared< concatenating_sequence<iter> >();
+	for (auto& s : segs) seq->append(s.begin(), s.end());
+
+	std::size_t n = 0;
+	std::string serial_str;
+	long serial_odd = 0;
+	for (auto i = seq->begin(); i != seq->end(); ++i)
+	{
+		++n;
+		serial_str += std::to_string(*i) + ",";
+		if (*i % 2) ++serial_odd;
+	}
+
+	// each element exactly once
+	std::vector< std::atomic<int> > seen(n);
+	for (auto& s : seen) s.store(0);
+	parallel_for_each(*seq, [&seen](int x) { seen[x].fetch_add(1); }, pool);
+	for (auto& s : seen) check(s.load() == 1, what);
+
+	// string concatenation doesn't commute, so this checks the order too
+	std::string str = parallel_transform_reduce(*seq, std::string(),
+		[](std::string a, std::string b) { return a + b; },
+		[](int x) { return std::to_string(x) + ","; }, pool);
+	check(str == serial_str, what);
+
+	check(parallel_count_if(*seq, [](int x) { return x % 2 != 0; }, pool) == serial_odd, what);
+}
+
+int main()
+{
+	thread_pool pool(3);
+	// big enough that random-access segments are cut across boundaries
+	std::vector<std::size_t> lengths = { 0, 10000, 0, 0, 1, 30000, 7, 0, 20000, 0 };
+	test_against_serial< std::vector<int> >("vector segments match a serial walk", lengths, pool);
+	test_against_serial< std::list<int> >("list segments match a serial walk", lengths, pool);
+	std::vector<std::size_t> empties = { 0, 0, 0 };
+	test_against_serial< std::vector<int> >("empty vector segments match a serial walk", empties, pool);
+	test_against_serial< std::list<int> >("empty list segments match a serial walk", empties, pool);
+	return 0;
+}